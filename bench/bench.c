@@ -0,0 +1,371 @@
+/*
+ * Modbusfs benchmark: workload driver
+ *
+ * Copyright (C) 2013-2014	Rodolfo Giometti <giometti@linux.it>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * The driver exports a client and a range of its holding registers into
+ * an already mounted modbusfs tree, then runs several threads issuing
+ * random reads and writes for a fixed time. Each operation is a single
+ * system call: a pread()/pwrite() on a register file or, in map mode, a
+ * pread()/pwrite() of a random range on the client's "regs" file. Every
+ * operation's latency is recorded so that throughput and percentiles can
+ * be reported at the end.
+ */
+
+#define NAME		"bench"
+
+enum op_e {
+	OP_READ,
+	OP_WRITE,
+	OPS_NUM,
+};
+
+static const char *op_names[OPS_NUM] = {
+	[OP_READ]	= "read",
+	[OP_WRITE]	= "write",
+};
+
+struct samples_s {
+	uint32_t *lat;			/* latencies in usecs */
+	size_t num, size;
+	unsigned long errors;
+};
+
+struct worker_s {
+	pthread_t thread;
+	unsigned int seed;
+	struct samples_s samples[OPS_NUM];
+};
+
+static const char *mnt;
+static int threads = 4;
+static int seconds = 5;
+static int write_pct = 20;
+static int addr = 1;
+static int first;
+static int count = 100;
+static int map_mode;
+static int range = 16;
+static const char *reg_opts = "";
+
+static int *fds;			/* register files, shared by workers */
+static int map_fd;
+static volatile int stop;
+
+/*
+ * Local functions
+ */
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: %s [options] <mountpoint>\n", NAME);
+	fprintf(stderr, "\t-t <n>\t\tworker threads (default %d)\n"
+		"\t-s <secs>\trun time (default %d)\n"
+		"\t-w <pct>\twrites percentage (default %d)\n"
+		"\t-a <addr>\tslave address (default %d)\n"
+		"\t-f <idx>\tfirst register (default %d)\n"
+		"\t-n <num>\tregisters number (default %d)\n"
+		"\t-o <opts>\tregisters export options (e.g. \"100ms\")\n"
+		"\t-m <num>\tmap mode: access the \"regs\" file by ranges "
+		"of up to <num> registers\n",
+		threads, seconds, write_pct, addr, first, count);
+	exit(EXIT_FAILURE);
+}
+
+static void export(const char *path, const char *line)
+{
+	int fd;
+	int ret;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: cannot open %s: %m\n", NAME, path);
+		exit(EXIT_FAILURE);
+	}
+	ret = write(fd, line, strlen(line));
+	if (ret < 0 && errno != EEXIST) {
+		fprintf(stderr, "%s: cannot export \"%s\": %m\n", NAME, line);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+}
+
+static void setup(void)
+{
+	char path[4096], line[256];
+	int i;
+
+	snprintf(path, sizeof(path), "%s/exports", mnt);
+	snprintf(line, sizeof(line), "%d 0755", addr);
+	export(path, line);
+
+	if (map_mode) {
+		snprintf(path, sizeof(path), "%s/%d/regs", mnt, addr);
+		map_fd = open(path, O_RDWR);
+		if (map_fd < 0) {
+			fprintf(stderr, "%s: cannot open %s: %m\n", NAME, path);
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+
+	fds = calloc(count, sizeof(*fds));
+	if (!fds) {
+		fprintf(stderr, "%s: out of memory\n", NAME);
+		exit(EXIT_FAILURE);
+	}
+
+	snprintf(path, sizeof(path), "%s/%d/exports", mnt, addr);
+	for (i = 0; i < count; i++) {
+		snprintf(line, sizeof(line), "%d 0666 %s", first + i, reg_opts);
+		export(path, line);
+	}
+
+	for (i = 0; i < count; i++) {
+		snprintf(path, sizeof(path), "%s/%d/%d", mnt, addr, first + i);
+		fds[i] = open(path, O_RDWR);
+		if (fds[i] < 0) {
+			fprintf(stderr, "%s: cannot open %s: %m\n", NAME, path);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void record(struct samples_s *s, uint32_t lat, int ok)
+{
+	if (!ok) {
+		s->errors++;
+		return;
+	}
+
+	if (s->num == s->size) {
+		s->size = s->size ? s->size * 2 : 4096;
+		s->lat = realloc(s->lat, s->size * sizeof(*s->lat));
+		if (!s->lat) {
+			fprintf(stderr, "%s: out of memory\n", NAME);
+			exit(EXIT_FAILURE);
+		}
+	}
+	s->lat[s->num++] = lat;
+}
+
+static int do_op(struct worker_s *w, enum op_e op)
+{
+	uint8_t buf[2 * 125];
+	char str[8];
+	int idx, nb;
+	int ret;
+
+	if (map_mode) {
+		nb = 1 + rand_r(&w->seed) % range;
+		idx = first + rand_r(&w->seed) % (count - nb + 1);
+		if (op == OP_READ)
+			ret = pread(map_fd, buf, 2 * nb, 2 * idx);
+		else {
+			memset(buf, rand_r(&w->seed), 2 * nb);
+			ret = pwrite(map_fd, buf, 2 * nb, 2 * idx);
+		}
+
+		return ret == 2 * nb;
+	}
+
+	idx = rand_r(&w->seed) % count;
+	if (op == OP_READ) {
+		ret = pread(fds[idx], str, sizeof(str), 0);
+		return ret > 0;
+	}
+
+	nb = snprintf(str, sizeof(str), "%x", rand_r(&w->seed) & 0xffff);
+	ret = pwrite(fds[idx], str, nb, 0);
+	return ret == nb;
+}
+
+static void *worker(void *arg)
+{
+	struct worker_s *w = arg;
+	enum op_e op;
+	uint64_t t0;
+	int ok;
+
+	while (!stop) {
+		op = rand_r(&w->seed) % 100 < write_pct ? OP_WRITE : OP_READ;
+
+		t0 = now_us();
+		ok = do_op(w, op);
+		record(&w->samples[op], now_us() - t0, ok);
+	}
+
+	return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const struct samples_s *s, double p)
+{
+	size_t i;
+
+	if (!s->num)
+		return 0;
+	i = (size_t) (p / 100 * s->num);
+	return s->lat[i < s->num ? i : s->num - 1];
+}
+
+static void report(struct worker_s *w, double elapsed)
+{
+	struct samples_s all;
+	enum op_e op;
+	int i;
+
+	printf("%-6s %10s %10s %8s %8s %8s %8s %8s %8s\n", "op", "ops",
+	       "ops/s", "errors", "p50", "p90", "p99", "p99.9", "max");
+
+	for (op = 0; op < OPS_NUM; op++) {
+		memset(&all, 0, sizeof(all));
+		for (i = 0; i < threads; i++)
+			all.num += w[i].samples[op].num;
+		all.lat = malloc((all.num + 1) * sizeof(*all.lat));
+		if (!all.lat) {
+			fprintf(stderr, "%s: out of memory\n", NAME);
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < threads; i++) {
+			memcpy(all.lat + all.size, w[i].samples[op].lat,
+			       w[i].samples[op].num * sizeof(*all.lat));
+			all.size += w[i].samples[op].num;
+			all.errors += w[i].samples[op].errors;
+		}
+		qsort(all.lat, all.num, sizeof(*all.lat), cmp_u32);
+
+		printf("%-6s %10zu %10.0f %8lu %8u %8u %8u %8u %8u\n",
+		       op_names[op], all.num, all.num / elapsed, all.errors,
+		       percentile(&all, 50), percentile(&all, 90),
+		       percentile(&all, 99), percentile(&all, 99.9),
+		       percentile(&all, 100));
+		free(all.lat);
+	}
+	printf("(latencies in usecs)\n");
+}
+
+/*
+ * Main
+ */
+
+int main(int argc, char *argv[])
+{
+	struct worker_s *w;
+	uint64_t t0;
+	int i, c;
+	int ret;
+
+	while ((c = getopt(argc, argv, "t:s:w:a:f:n:o:m:h")) != -1) {
+		switch (c) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'w':
+			write_pct = atoi(optarg);
+			break;
+		case 'a':
+			addr = atoi(optarg);
+			break;
+		case 'f':
+			first = atoi(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'o':
+			reg_opts = optarg;
+			break;
+		case 'm':
+			map_mode = 1;
+			range = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	mnt = argv[optind];
+
+	if (threads < 1 || seconds < 1 || write_pct < 0 || write_pct > 100 ||
+	    addr < 0 || addr > 255 || first < 0 || count < 1 ||
+	    first + count > 65536 || range < 1 || range > 123 ||
+	    (map_mode && range > count))
+		usage();
+
+	setup();
+
+	w = calloc(threads, sizeof(*w));
+	if (!w) {
+		fprintf(stderr, "%s: out of memory\n", NAME);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%s: %d threads, %d%% writes, %d %s, %d secs\n", NAME,
+	       threads, write_pct, count,
+	       map_mode ? "mapped registers" : "register files", seconds);
+
+	t0 = now_us();
+	for (i = 0; i < threads; i++) {
+		w[i].seed = i + 1;
+		ret = pthread_create(&w[i].thread, NULL, worker, &w[i]);
+		if (ret) {
+			fprintf(stderr, "%s: cannot start worker: %s\n",
+				NAME, strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < threads; i++)
+		pthread_join(w[i].thread, NULL);
+
+	report(w, (now_us() - t0) / 1e6);
+
+	return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Modbusfs benchmark: path resolution microbenchmark
+ *
+ * Copyright (C) 2013-2014	Rodolfo Giometti <giometti@linux.it>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The resolver is made of methods.c's local functions, so we include
+ * it as is and drive it directly: no mount, no kernel and no MODBUS
+ * traffic, just the CPU time spent by modbusfs on each lookup. A bus is
+ * set up (without starting its workers) and a client with a range of
+ * holding registers is exported through the "exports" files code, then
+ * random registers are looked up for a fixed number of iterations:
+ *
+ *	lookup	one FUSE lookup, that is "<idx>" into the client directory
+ *		(inode decoding, name parsing, index lookup and stat)
+ *	walk	the whole "/<addr>/<idx>" path from the top directory
+ *
+ * Each time includes the snprintf() building the register's name.
+ */
+
+#include "../methods.c"
+
+int enable_debug;			/* modbusfs.c is not linked */
+
+static int addr = 10;
+static int count = 2000;
+static long iters = 1000000;
+
+/*
+ * Local functions
+ */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: %s [-a <addr>] [-n <num>] [-i <iters>]\n",
+		NAME);
+	fprintf(stderr, "\t-a <addr>\tclient address (default %d)\n"
+		"\t-n <num>\tregisters number (default %d)\n"
+		"\t-i <iters>\tlookups per test (default %ld)\n",
+		addr, count, iters);
+	exit(EXIT_FAILURE);
+}
+
+static void setup(void)
+{
+	struct modbusfs_data_s data = {
+		.ctrl_file	= CTRL_EXPORTS,
+		.bit		= -1,
+	};
+	modbus_t *ctx;
+	char line[64];
+	int ret;
+
+	ctx = modbus_new_tcp("127.0.0.1", 502);	/* never connected */
+	buses = calloc(1, sizeof(*buses));
+	if (!ctx || !buses) {
+		fprintf(stderr, "%s: out of memory\n", NAME);
+		exit(EXIT_FAILURE);
+	}
+	buses_num = 1;
+	if (bus_init(&buses[0], 0, &ctx, 1, 1) < 0) {
+		fprintf(stderr, "%s: cannot init the bus\n", NAME);
+		exit(EXIT_FAILURE);
+	}
+
+	data.bus = &buses[0];
+	snprintf(line, sizeof(line), "%d 0755", addr);
+	ret = file_write(&data, line, strlen(line), 0);
+	if (ret < 0) {
+		fprintf(stderr, "%s: cannot export client: %s\n", NAME,
+			strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+
+	data.cli = find_client(&buses[0], addr);
+	snprintf(line, sizeof(line), "0-%d 0444", count - 1);
+	ret = file_write(&data, line, strlen(line), 0);
+	if (ret < 0) {
+		fprintf(stderr, "%s: cannot export registers: %s\n", NAME,
+			strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Mimic modbusfs_lookup() without the reply */
+static int lookup(fuse_ino_t parent, const char *name, fuse_ino_t *ino)
+{
+	struct modbusfs_node_s n;
+	struct stat st;
+	int ret;
+
+	ret = ino_node(parent, &n);
+	if (ret == 0)
+		ret = lookup_node(&n, name);
+	if (ret < 0)
+		return ret;
+
+	*ino = node_ino(&n);
+	node_stat(&n, &st);
+
+	return 0;
+}
+
+static void run(const char *test, int walk)
+{
+	fuse_ino_t dir, ino;
+	unsigned int seed = 1;
+	char name[16];
+	uint64_t t0, t;
+	long i;
+	int ret = 0;
+
+	snprintf(name, sizeof(name), "%d", addr);
+	ret = lookup(FUSE_ROOT_ID, name, &dir);
+
+	t0 = now_ns();
+	for (i = 0; i < iters && ret == 0; i++) {
+		if (walk) {
+			snprintf(name, sizeof(name), "%d", addr);
+			ret = lookup(FUSE_ROOT_ID, name, &dir);
+			if (ret < 0)
+				break;
+		}
+		snprintf(name, sizeof(name), "%d", rand_r(&seed) % count);
+		ret = lookup(dir, name, &ino);
+	}
+	t = now_ns() - t0;
+
+	if (ret < 0) {
+		fprintf(stderr, "%s: lookup of \"%s\" failed: %s\n", NAME,
+			name, strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%-8s %10ld %10.1f\n", test, iters, (double) t / iters);
+}
+
+/*
+ * Main
+ */
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "a:n:i:h")) != -1) {
+		switch (c) {
+		case 'a':
+			addr = atoi(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'i':
+			iters = atol(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || addr < 1 || addr > 247 || count < 1 ||
+	    count > 65536 || iters < 1)
+		usage();
+
+	setup();
+
+	printf("%s: client %d, %d registers\n", NAME, addr, count);
+	printf("%-8s %10s %10s\n", "test", "calls", "ns/call");
+	run("lookup", 0);
+	run("walk", 1);
+
+	return 0;
+}
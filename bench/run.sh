@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Modbusfs benchmark: start the simulated slave, mount modbusfs against
+# it and run the workload driver. Arguments, if any, are passed to the
+# driver; otherwise a default set of workloads is run.
+#
+# Environment:
+#	PORT	slave TCP port (default 1502)
+#	DEV	modbusfs connection options (default 1 connection, depth 4)
+#	DELAY	slave response delay in usecs (default 0)
+#	ERRORS	percentage of exception replies (default 0)
+#	DROPS	percentage of unanswered requests (default 0)
+#
+
+set -e
+
+BENCH_DIR=$(dirname "$0")
+PORT=${PORT:-1502}
+DEV=${DEV:-"1,4"}
+DELAY=${DELAY:-0}
+ERRORS=${ERRORS:-0}
+DROPS=${DROPS:-0}
+
+MNT=$(mktemp -d)
+SLAVE_PID=
+FS_PID=
+
+cleanup() {
+	[ -n "$FS_PID" ] && { fusermount -u "$MNT" 2>/dev/null || \
+			      kill "$FS_PID" 2>/dev/null; wait "$FS_PID" || true; }
+	[ -n "$SLAVE_PID" ] && { kill "$SLAVE_PID" 2>/dev/null; \
+				 wait "$SLAVE_PID" || true; }
+	rmdir "$MNT"
+}
+trap cleanup EXIT INT TERM
+
+"$BENCH_DIR"/slave -p "$PORT" -d "$DELAY" -e "$ERRORS" -x "$DROPS" &
+SLAVE_PID=$!
+sleep 0.2
+
+"$BENCH_DIR"/../modbusfs tcp:127.0.0.1:"$PORT","$DEV" "$MNT" -f &
+FS_PID=$!
+
+i=0
+while [ ! -e "$MNT"/exports ]; do
+	i=$((i + 1))
+	if [ $i -gt 50 ]; then
+		echo "run.sh: modbusfs did not mount" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+echo "slave: delay ${DELAY}us, ${ERRORS}% exceptions, ${DROPS}% drops"
+echo "modbusfs: tcp:127.0.0.1:$PORT,$DEV"
+echo
+
+if [ $# -gt 0 ]; then
+	"$BENCH_DIR"/bench "$@" "$MNT"
+	exit 0
+fi
+
+"$BENCH_DIR"/bench -t 1 -w 0 "$MNT"
+echo
+"$BENCH_DIR"/bench -t 16 -w 0 "$MNT"
+echo
+"$BENCH_DIR"/bench -t 16 -w 20 "$MNT"
+echo
+"$BENCH_DIR"/bench -t 16 -w 20 -f 1000 -o 100ms "$MNT"
+echo
+"$BENCH_DIR"/bench -t 16 -w 20 -m 64 -n 1000 "$MNT"
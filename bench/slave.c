@@ -0,0 +1,182 @@
+/*
+ * Modbusfs benchmark: simulated MODBUS slave
+ *
+ * Copyright (C) 2013-2014	Rodolfo Giometti <giometti@linux.it>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <modbus.h>
+
+/*
+ * A MODBUS/TCP server listening on the loopback interface which answers
+ * any unit identifier with the same register tables. Each request is
+ * answered after a configurable delay (the slave's turnaround time) and
+ * a configurable percentage of them gets a "Slave Device Failure"
+ * exception or no answer at all, so that the retry and timeout paths of
+ * modbusfs are exercised too. Requests are served one at a time as a
+ * real slave would do.
+ */
+
+#define NAME		"slave"
+#define CONNS_MAX	16
+
+static int port = 1502;
+static int delay_us;
+static int error_pct;
+static int drop_pct;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: %s [-p <port>] [-d <delay_us>] "
+			"[-e <error%%>] [-x <drop%%>]\n", NAME);
+	fprintf(stderr, "\t-p <port>\tTCP port to listen on (default %d)\n"
+		"\t-d <delay_us>\tresponse delay in microseconds\n"
+		"\t-e <error%%>\tpercentage of requests answered with "
+		"an exception\n"
+		"\t-x <drop%%>\tpercentage of requests never answered\n",
+		port);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	modbus_t *ctx;
+	modbus_mapping_t *map;
+	uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+	fd_set set, rset;
+	int server, fdmax, fd;
+	int conns = 0;
+	int i, c;
+	int ret;
+
+	while ((c = getopt(argc, argv, "p:d:e:x:h")) != -1) {
+		switch (c) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'd':
+			delay_us = atoi(optarg);
+			break;
+		case 'e':
+			error_pct = atoi(optarg);
+			break;
+		case 'x':
+			drop_pct = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (port < 1 || port > 65535 || delay_us < 0 ||
+	    error_pct < 0 || drop_pct < 0 || error_pct + drop_pct > 100)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+	srand(getpid());
+
+	ctx = modbus_new_tcp("127.0.0.1", port);
+	if (!ctx) {
+		fprintf(stderr, "%s: cannot create context: %s\n",
+			NAME, modbus_strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* Map the whole addresses space of each table */
+	map = modbus_mapping_new(65536, 65536, 65536, 65536);
+	if (!map) {
+		fprintf(stderr, "%s: cannot allocate tables: %s\n",
+			NAME, modbus_strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < 65536; i++) {
+		map->tab_registers[i] = i;
+		map->tab_input_registers[i] = ~i;
+		map->tab_input_bits[i] = i & 1;
+	}
+
+	server = modbus_tcp_listen(ctx, CONNS_MAX);
+	if (server < 0) {
+		fprintf(stderr, "%s: cannot listen on port %d: %s\n",
+			NAME, port, modbus_strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	FD_ZERO(&set);
+	FD_SET(server, &set);
+	fdmax = server;
+
+	for (;;) {
+		rset = set;
+		ret = select(fdmax + 1, &rset, NULL, NULL, NULL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(NAME ": select");
+			exit(EXIT_FAILURE);
+		}
+
+		for (fd = 0; fd <= fdmax; fd++) {
+			if (!FD_ISSET(fd, &rset))
+				continue;
+
+			if (fd == server) {
+				ret = accept(server, NULL, NULL);
+				if (ret < 0)
+					continue;
+				if (conns == CONNS_MAX) {
+					close(ret);
+					continue;
+				}
+				conns++;
+				FD_SET(ret, &set);
+				fdmax = ret > fdmax ? ret : fdmax;
+				continue;
+			}
+
+			modbus_set_socket(ctx, fd);
+			ret = modbus_receive(ctx, query);
+			if (ret == 0)
+				continue;	/* not for us */
+			if (ret < 0) {
+				close(fd);
+				FD_CLR(fd, &set);
+				conns--;
+				continue;
+			}
+
+			if (delay_us)
+				usleep(delay_us);
+
+			c = rand() % 100;
+			if (c < drop_pct)
+				continue;
+			if (c < drop_pct + error_pct)
+				modbus_reply_exception(ctx, query,
+					MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE);
+			else
+				modbus_reply(ctx, query, ret, map);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,1324 @@
+/*
+ * Modbusfs bus engine
+ *
+ * Copyright (C) 2013-2014	Rodolfo Giometti <giometti@linux.it>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "modbusfs.h"
+
+/*
+ * All MODBUS transactions of a bus are executed by the worker threads
+ * of its connections (just one for RTU). Callers queue a request and
+ * sleep until a worker marks it as done, or they give it a callback the
+ * worker calls at completion time; while workers are busy on the
+ * wire new requests pile up into the queue and, at the next round,
+ * pending reads for the same slave and table whose indexes are close
+ * enough are merged into one single transaction (FC01, FC02, FC03 or
+ * FC04).
+ *
+ * When a bus has more connections all requests for a slave are served
+ * by one connection at time, so they are never reordered. Pipelined
+ * requests may be executed by the gateway in any order, so a write is
+ * never in flight together with other requests for the same slave.
+ *
+ * Requests are queued per scheduling class and per slave. Workers serve
+ * the highest priority class having requests, and the slaves of a class
+ * in round-robin, but a lower class is served at least once every
+ * "starve_limit" batches so it never starves. Reads never overtake an
+ * older write to the same slave.
+ *
+ * Each executed transaction is accounted into the statistics of its
+ * connection's worker (see struct modbusfs_stats_s) and into the health
+ * of its slave (see struct modbusfs_slave_s): a transaction timing out
+ * before the configured response timeout is retried once with the full
+ * timeout, unless the slave already timed out, so that a slow answer is
+ * not taken for a dead slave.
+ *
+ * Writes to the broadcast address are sent as raw frames, since no
+ * answer has to be waited for, followed by the turnaround delay which
+ * gives all the slaves the time to process them before the next
+ * request. They are never pipelined and they don't count into any
+ * slave's health.
+ */
+
+int coalesce_gap = COALESCE_GAP_DEF;
+int broadcast_delay = BROADCAST_DELAY_DEF;
+
+/* Max batches served by upper classes while a class is waiting */
+static const int starve_limit[CLASSES_NUM] = {
+	[CLASS_CONTROL]		= 0,	/* never waits */
+	[CLASS_INTERACTIVE]	= 4,
+	[CLASS_BULK]		= 16,
+};
+
+/* Read function code for each registers type */
+const enum bus_op_e bus_read_op[REG_TYPES_NUM] = {
+	[REG_HOLDING]	= BUS_READ_REGISTERS,
+	[REG_INPUT]	= BUS_READ_INPUT_REGISTERS,
+	[REG_COIL]	= BUS_READ_COILS,
+	[REG_DISCRETE]	= BUS_READ_DISCRETE_INPUTS,
+};
+
+/* Function code of each operation */
+const uint8_t bus_op_fc[BUS_OPS_NUM] = {
+	[BUS_READ_REGISTERS]		= 0x03,
+	[BUS_WRITE_REGISTER]		= 0x06,
+	[BUS_WRITE_REGISTERS]		= 0x10,
+	[BUS_READ_INPUT_REGISTERS]	= 0x04,
+	[BUS_READ_COILS]		= 0x01,
+	[BUS_READ_DISCRETE_INPUTS]	= 0x02,
+	[BUS_WRITE_COIL]		= 0x05,
+	[BUS_WRITE_COILS]		= 0x0f,
+	[BUS_REPORT_SLAVE_ID]		= 0x11,
+	[BUS_MASK_WRITE_REGISTER]	= 0x16,
+	[BUS_WRITE_AND_READ_REGISTERS]	= 0x17,
+};
+
+/*
+ * Local functions
+ */
+
+/* Lock the requests queues keeping track of the contention */
+static void bus_lock(struct modbusfs_bus_s *bus)
+{
+	uint64_t t;
+
+	if (pthread_mutex_trylock(&bus->mutex) == 0)
+		return;
+
+	t = now_us();
+	EXIT_ON(pthread_mutex_lock(&bus->mutex));
+
+	/* Protected by the mutex itself */
+	bus->mutex_wait += now_us() - t;
+	bus->mutex_contended++;
+}
+
+static int is_read(enum bus_op_e op)
+{
+	switch (op) {
+	case BUS_READ_REGISTERS:
+	case BUS_READ_INPUT_REGISTERS:
+	case BUS_READ_COILS:
+	case BUS_READ_DISCRETE_INPUTS:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+/* Writes that can be sent to the broadcast address by do_broadcast() */
+static int can_broadcast(enum bus_op_e op)
+{
+	switch (op) {
+	case BUS_WRITE_REGISTER:
+	case BUS_WRITE_REGISTERS:
+	case BUS_WRITE_COIL:
+	case BUS_WRITE_COILS:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+static int is_bit_read(enum bus_op_e op)
+{
+	return op == BUS_READ_COILS || op == BUS_READ_DISCRETE_INPUTS;
+}
+
+static void enqueue(struct modbusfs_queue_s *q, struct modbusfs_req_s *req)
+{
+	req->next = NULL;
+	if (q->tail)
+		q->tail->next = req;
+	else
+		q->head = req;
+	q->tail = req;
+}
+
+static void dequeue(struct modbusfs_bus_s *bus, struct modbusfs_queue_s *q,
+		    struct modbusfs_req_s *prev, struct modbusfs_req_s *req)
+{
+	struct modbusfs_class_stats_s *st = &bus->stats[req->class];
+	uint64_t wait = now_us() - req->stamp;
+
+	if (prev)
+		prev->next = req->next;
+	else
+		q->head = req->next;
+	if (q->tail == req)
+		q->tail = prev;
+	req->next = NULL;
+
+	st->depth--;
+	st->reqs++;
+	st->wait_sum += wait;
+	st->wait_max = max(st->wait_max, wait);
+}
+
+/* Return the sequence number of the oldest queued write to a slave */
+static uint64_t first_write(struct modbusfs_bus_s *bus, int addr)
+{
+	struct modbusfs_req_s *req = bus->queue[CLASS_CONTROL][addr].head;
+
+	return req ? req->seq : UINT64_MAX;
+}
+
+/*
+ * Return the next slave, in round-robin order, having requests of class
+ * "c" the connection can serve or -1
+ */
+static int next_slave(struct modbusfs_conn_s *conn, enum bus_class_e c)
+{
+	struct modbusfs_bus_s *bus = conn->bus;
+	struct modbusfs_req_s *req;
+	int i, addr;
+
+	for (i = 1; i <= CLIENTS_MAX; i++) {
+		addr = (bus->rr[c] + i) % CLIENTS_MAX;
+		req = bus->queue[c][addr].head;
+		if (!req)
+			continue;
+
+		if (bus->owner[addr] && bus->owner[addr] != conn)
+			continue;
+		if (req->seq > first_write(bus, addr))
+			continue;
+
+		/* Keep writes alone on the pipeline */
+		if (bus->writing[addr] ||
+		    (!is_read(req->op) && bus->inflight[addr]))
+			continue;
+
+		return addr;
+	}
+
+	return -1;
+}
+
+/* Return true if the MODBUS error is a slave's exception */
+static int is_exception(int errnum)
+{
+	return errnum > MODBUS_ENOBASE && errnum < EMBBADCRC;
+}
+
+/* Return the latency histogram bucket of "us" microseconds */
+static int hist_bucket(uint64_t us)
+{
+	int e, b;
+
+	if (us < 2 * HIST_SUB)
+		return us;
+
+	e = 63 - __builtin_clzll(us);		/* us >= 2^e */
+	b = (e - 1) * HIST_SUB + ((us >> (e - 2)) & (HIST_SUB - 1));
+
+	return min(b, HIST_BUCKETS - 1);
+}
+
+/* Return the highest latency counted into a histogram bucket */
+static uint64_t hist_value(int b)
+{
+	int e;
+
+	if (b < 2 * HIST_SUB)
+		return b;
+
+	e = b / HIST_SUB + 1;
+	return ((uint64_t) (HIST_SUB + b % HIST_SUB + 1) << (e - 2)) - 1;
+}
+
+/* Return the request and response PDU sizes of a transaction */
+static void pdu_sizes(enum bus_op_e op, int nb, int *req, int *rsp)
+{
+	switch (op) {
+	case BUS_READ_REGISTERS:
+	case BUS_READ_INPUT_REGISTERS:
+		*req = 5;
+		*rsp = 2 + nb * 2;
+		break;
+
+	case BUS_READ_COILS:
+	case BUS_READ_DISCRETE_INPUTS:
+		*req = 5;
+		*rsp = 2 + (nb + 7) / 8;
+		break;
+
+	case BUS_WRITE_REGISTER:
+	case BUS_WRITE_COIL:
+		*req = 5;
+		*rsp = 5;
+		break;
+
+	case BUS_WRITE_REGISTERS:
+		*req = 6 + nb * 2;
+		*rsp = 5;
+		break;
+
+	case BUS_WRITE_COILS:
+		*req = 6 + (nb + 7) / 8;
+		*rsp = 5;
+		break;
+
+	case BUS_REPORT_SLAVE_ID:
+		*req = 1;
+		*rsp = 4;	/* additional data not counted */
+		break;
+
+	case BUS_MASK_WRITE_REGISTER:
+		*req = 7;
+		*rsp = 7;
+		break;
+
+	case BUS_WRITE_AND_READ_REGISTERS:
+		*req = 10 + nb * 2;
+		*rsp = 2;	/* plus the read registers */
+		break;
+
+	default:
+		BUG();
+	}
+}
+
+/*
+ * Account a transaction into the connection's statistics, "busy" is the
+ * bus time it used. Only the connection's worker can call this.
+ */
+static void account(struct modbusfs_conn_s *conn, int addr, enum bus_op_e op,
+		    int nb, int ret, int err, uint64_t lat, uint64_t busy)
+{
+	struct modbusfs_stats_s *st = &conn->stats[addr];
+	int req, rsp;
+
+	pdu_sizes(op, nb, &req, &rsp);
+	if (op == BUS_WRITE_AND_READ_REGISTERS && ret > 0)
+		rsp += ret * 2;
+	req += conn->adu_extra;
+	rsp += conn->adu_extra;
+
+	STAT_ADD(st->tx[op], 1);
+	if (is_broadcast(addr))
+		rsp = 0;
+	if (ret == -1) {
+		if (err == ETIMEDOUT) {
+			STAT_ADD(st->timeouts, 1);
+			rsp = 0;
+		} else if (err == EMBBADCRC)
+			STAT_ADD(st->crc_errors, 1);
+		else if (is_exception(err)) {
+			STAT_ADD(st->exceptions, 1);
+			rsp = 2 + conn->adu_extra;
+		} else
+			STAT_ADD(st->errors, 1);
+	}
+	STAT_ADD(st->bytes_tx, req);
+	STAT_ADD(st->bytes_rx, rsp);
+
+	STAT_ADD(st->busy, busy);
+	STAT_ADD(st->lat[hist_bucket(lat)], 1);
+	if (lat > st->lat_max)
+		__atomic_store_n(&st->lat_max, lat, __ATOMIC_RELAXED);
+}
+
+/* Set the connection's response timeout in ms */
+static void set_timeout(struct modbusfs_conn_s *conn, unsigned int ms)
+{
+	if (ms == conn->timeout)
+		return;
+
+	modbus_set_response_timeout(conn->ctx, ms / 1000, (ms % 1000) * 1000);
+	conn->timeout = ms;
+}
+
+/*
+ * Mark a request as done, the ones having a callback are added to the
+ * "async" list to be completed once bus->mutex is released. Must hold
+ * bus->mutex.
+ */
+static void req_done(struct modbusfs_req_s *req, struct modbusfs_req_s **async)
+{
+	if (req->callback) {
+		req->next = *async;
+		*async = req;
+	} else
+		req->done = 1;
+}
+
+/* Call the callbacks of a list built by req_done() */
+static void complete_async(struct modbusfs_req_s *req)
+{
+	struct modbusfs_req_s *next;
+
+	for (; req; req = next) {
+		next = req->next;
+		req->callback(req);
+	}
+}
+
+/* Fail all the queued requests to a slave, must hold bus->mutex */
+static void fail_slave(struct modbusfs_bus_s *bus, int addr, int err,
+		       struct modbusfs_req_s **async)
+{
+	struct modbusfs_req_s *req;
+	int c;
+
+	for (c = 0; c < CLASSES_NUM; c++)
+		while ((req = bus->queue[c][addr].head)) {
+			dequeue(bus, &bus->queue[c][addr], NULL, req);
+			req->ret = -1;
+			req->err = err;
+			req_done(req, async);
+		}
+}
+
+/*
+ * Update a slave's health by the result of an executed batch, must hold
+ * bus->mutex
+ */
+static void update_slave(struct modbusfs_bus_s *bus,
+			 struct modbusfs_batch_s *batch,
+			 struct modbusfs_req_s **async)
+{
+	struct modbusfs_req_s *req = batch->reqs;
+	struct modbusfs_slave_s *slave = &bus->slaves[req->addr];
+	uint64_t lat = max(batch->lat, (uint64_t) 1);
+	uint64_t delta;
+	int alive;
+
+	if (is_broadcast(req->addr))
+		return;
+	if (req->probe)
+		slave->probing = 0;
+
+	/* Missing slaves found by a scan are not worth any probe */
+	alive = bus_answered(batch->ret, batch->err);
+	if (!alive && req->scan)
+		return;
+	if (!alive) {
+		if (slave->quarantined) {
+			slave->backoff = min(slave->backoff * 2,
+					(unsigned int) QUARANTINE_BACKOFF_MAX);
+			slave->next_probe = now_ms() + slave->backoff;
+			return;
+		}
+		if (batch->err != ETIMEDOUT)
+			return;
+		if (++slave->fails < QUARANTINE_FAILS)
+			return;
+
+		err("bus%d: slave %d is not answering, quarantined",
+		    bus->id, req->addr);
+		slave->quarantined = 1;
+		slave->backoff = QUARANTINE_BACKOFF_MIN;
+		slave->next_probe = now_ms() + slave->backoff;
+		fail_slave(bus, req->addr, EIO, async);
+		return;
+	}
+
+	if (slave->quarantined)
+		err("bus%d: slave %d is back", bus->id, req->addr);
+	slave->quarantined = 0;
+	slave->fails = 0;
+
+	/* Jacobson's estimator, as TCP's retransmission timeout */
+	if (!slave->srtt) {
+		slave->srtt = lat;
+		slave->rttvar = lat / 2;
+		return;
+	}
+	delta = lat > slave->srtt ? lat - slave->srtt : slave->srtt - lat;
+	slave->rttvar = slave->rttvar - slave->rttvar / 4 + delta / 4;
+	slave->srtt = slave->srtt - slave->srtt / 8 + lat / 8;
+}
+
+/*
+ * Pick up the next request the connection can serve and, if it's a
+ * read, merge into it all the pending reads for the same slave falling
+ * inside the coalescing gap, whatever their class. The resulting batch
+ * holds the merged requests as a linked list and the overall registers
+ * range to read.
+ *
+ * We never merge reads queued after a write to the same slave, so
+ * that a read can never return a value older than a previous write.
+ * Must be called with bus->mutex held.
+ */
+static int get_batch(struct modbusfs_conn_s *conn,
+		     struct modbusfs_batch_s *batch)
+{
+	struct modbusfs_bus_s *bus = conn->bus;
+	struct modbusfs_req_s *first, *last, *prev, *req;
+	struct modbusfs_slave_s *slave;
+	enum bus_class_e order[CLASSES_NUM * 2];
+	int c, i, n = 0;
+	int addr = -1;
+	uint64_t limit;
+	int r_lo, r_hi;
+	int gap, max;
+	int merged;
+
+	/* Starving classes first, then all classes by priority */
+	for (c = 0; c < CLASSES_NUM; c++)
+		if (bus->stats[c].depth && starve_limit[c] &&
+		    bus->skipped[c] >= starve_limit[c])
+			order[n++] = c;
+	for (c = 0; c < CLASSES_NUM; c++)
+		if (bus->stats[c].depth)
+			order[n++] = c;
+
+	for (i = 0; i < n; i++) {
+		c = order[i];
+		addr = next_slave(conn, c);
+		if (addr >= 0)
+			break;
+	}
+	if (addr < 0)
+		return 0;
+
+	bus->rr[c] = addr;
+	bus->skipped[c] = 0;
+	for (i = c + 1; i < CLASSES_NUM; i++)
+		if (bus->stats[i].depth)
+			bus->skipped[i]++;
+
+	first = last = bus->queue[c][addr].head;
+	dequeue(bus, &bus->queue[c][addr], NULL, first);
+	batch->reqs = first;
+	batch->lo = first->idx;
+	batch->hi = first->idx + first->nb - 1;
+
+	bus->owner[addr] = conn;
+	bus->inflight[addr]++;
+
+	slave = &bus->slaves[addr];
+	batch->timeout = bus_slave_timeout(bus, slave);
+	batch->retry = !slave->fails && batch->timeout < bus->timeout_max &&
+		       !is_broadcast(addr);
+	if (first->timeout) {
+		batch->timeout = first->timeout;
+		batch->retry = 0;
+	}
+
+	if (!is_read(first->op)) {
+		bus->writing[addr]++;
+		return 1;
+	}
+
+	gap = bus_read_gap(first->op);
+	max = bus_read_max(first->op);
+	limit = first_write(bus, addr);
+	do {
+		merged = 0;
+
+		for (c = CLASS_INTERACTIVE; c < CLASSES_NUM && !merged; c++) {
+			prev = NULL;
+			for (req = bus->queue[c][addr].head; req;
+			     prev = req, req = req->next) {
+				if (req->seq > limit)
+					break;
+				if (req->op != first->op)
+					continue;
+
+				r_lo = min(batch->lo, req->idx);
+				r_hi = max(batch->hi, req->idx + req->nb - 1);
+				if (req->idx > batch->hi + gap + 1 ||
+				    req->idx + req->nb - 1 < batch->lo - gap - 1)
+					continue;
+				if (r_hi - r_lo + 1 > max)
+					continue;
+
+				dequeue(bus, &bus->queue[c][addr], prev, req);
+				last->next = req;
+				last = req;
+				batch->lo = r_lo;
+				batch->hi = r_hi;
+				merged = 1;
+				break;
+			}
+		}
+	} while (merged);
+
+	return 1;
+}
+
+static int do_read(struct modbusfs_conn_s *conn, enum bus_op_e op,
+		   int addr, int idx, int nb, uint16_t *dest)
+{
+	uint8_t bits[MODBUS_MAX_READ_BITS];
+	int i;
+	int ret;
+
+	ret = modbus_set_slave(conn->ctx, addr);
+	if (ret == -1)
+		return ret;
+
+	switch (op) {
+	case BUS_READ_REGISTERS:
+		return modbus_read_registers(conn->ctx, idx, nb, dest);
+
+	case BUS_READ_INPUT_REGISTERS:
+		return modbus_read_input_registers(conn->ctx, idx, nb, dest);
+
+	case BUS_READ_COILS:
+		ret = modbus_read_bits(conn->ctx, idx, nb, bits);
+		break;
+
+	case BUS_READ_DISCRETE_INPUTS:
+		ret = modbus_read_input_bits(conn->ctx, idx, nb, bits);
+		break;
+
+	default:
+		BUG();
+	}
+
+	for (i = 0; i < ret; i++)
+		dest[i] = bits[i];
+
+	return ret;
+}
+
+static int do_write(struct modbusfs_conn_s *conn, enum bus_op_e op,
+		    int addr, int idx, int nb, const uint16_t *src)
+{
+	uint8_t bits[MODBUS_MAX_WRITE_BITS];
+	int i;
+	int ret;
+
+	ret = modbus_set_slave(conn->ctx, addr);
+	if (ret == -1)
+		return ret;
+
+	switch (op) {
+	case BUS_WRITE_REGISTER:
+		return modbus_write_register(conn->ctx, idx, src[0]);
+
+	case BUS_WRITE_REGISTERS:
+		return modbus_write_registers(conn->ctx, idx, nb, src);
+
+	case BUS_WRITE_COIL:
+		return modbus_write_bit(conn->ctx, idx, !!src[0]);
+
+	case BUS_WRITE_COILS:
+		for (i = 0; i < nb; i++)
+			bits[i] = !!src[i];
+		return modbus_write_bits(conn->ctx, idx, nb, bits);
+
+	case BUS_MASK_WRITE_REGISTER:
+		return modbus_mask_write_register(conn->ctx, idx,
+						  src[0], src[1]);
+
+	default:
+		BUG();
+	}
+}
+
+/* Write and then read registers by one single transaction (FC23) */
+static int do_write_read(struct modbusfs_conn_s *conn,
+			 struct modbusfs_req_s *req)
+{
+	int ret;
+
+	ret = modbus_set_slave(conn->ctx, req->addr);
+	if (ret == -1)
+		return ret;
+
+	return modbus_write_and_read_registers(conn->ctx, req->idx, req->nb,
+					       req->val, req->read_idx,
+					       req->read_nb, req->dest);
+}
+
+/* Get the slave's identification (FC17), bytes are stored one per word */
+static int do_report_id(struct modbusfs_conn_s *conn, int addr,
+			int nb, uint16_t *dest)
+{
+	uint8_t id[MODBUS_TCP_MAX_ADU_LENGTH];
+	int i;
+	int ret;
+
+	ret = modbus_set_slave(conn->ctx, addr);
+	if (ret == -1)
+		return ret;
+
+	ret = modbus_report_slave_id(conn->ctx, sizeof(id), id);
+	if (ret == -1)
+		return ret;
+
+	ret = min(ret, nb);
+	for (i = 0; i < ret; i++)
+		dest[i] = id[i];
+
+	return ret;
+}
+
+/*
+ * Send a write to the broadcast address (FC05, FC06, FC15 or FC16) as a
+ * raw frame, since the libmodbus functions would wait for an answer
+ * which never comes, and then wait for the turnaround delay
+ */
+static int do_broadcast(struct modbusfs_conn_s *conn, enum bus_op_e op,
+			int idx, int nb, const uint16_t *src)
+{
+	uint8_t raw[7 + MODBUS_MAX_WRITE_REGISTERS * 2];
+	int len, i;
+	int ret;
+
+	raw[0] = MODBUS_BROADCAST_ADDRESS;
+	raw[1] = bus_op_fc[op];
+	raw[2] = idx >> 8;
+	raw[3] = idx & 0xff;
+
+	switch (op) {
+	case BUS_WRITE_REGISTER:
+		raw[4] = src[0] >> 8;
+		raw[5] = src[0] & 0xff;
+		len = 6;
+		break;
+
+	case BUS_WRITE_COIL:
+		raw[4] = src[0] ? 0xff : 0x00;
+		raw[5] = 0x00;
+		len = 6;
+		break;
+
+	case BUS_WRITE_REGISTERS:
+		raw[4] = nb >> 8;
+		raw[5] = nb & 0xff;
+		raw[6] = nb * 2;
+		for (i = 0; i < nb; i++) {
+			raw[7 + i * 2] = src[i] >> 8;
+			raw[8 + i * 2] = src[i] & 0xff;
+		}
+		len = 7 + nb * 2;
+		break;
+
+	case BUS_WRITE_COILS:
+		raw[4] = nb >> 8;
+		raw[5] = nb & 0xff;
+		raw[6] = (nb + 7) / 8;
+		memset(&raw[7], 0, raw[6]);
+		for (i = 0; i < nb; i++)
+			if (src[i])
+				raw[7 + i / 8] |= 1 << (i % 8);
+		len = 7 + raw[6];
+		break;
+
+	default:
+		BUG();
+	}
+
+	ret = modbus_send_raw_request(conn->ctx, raw, len);
+	if (ret == -1)
+		return ret;
+
+	usleep(broadcast_delay * 1000);
+
+	/* Some TCP gateways answer anyway, just drop it */
+	modbus_flush(conn->ctx);
+
+	return nb;
+}
+
+/* Execute a batch by using the blocking libmodbus functions */
+static void exec_batch(struct modbusfs_conn_s *conn,
+		       struct modbusfs_batch_s *batch)
+{
+	struct modbusfs_req_s *req = batch->reqs;
+	uint64_t t = now_us();
+
+	set_timeout(conn, batch->timeout);
+	if (is_broadcast(req->addr))
+		batch->ret = do_broadcast(conn, req->op, req->idx, req->nb,
+					  req->val);
+	else if (req->op == BUS_REPORT_SLAVE_ID)
+		batch->ret = do_report_id(conn, req->addr, req->nb, req->val);
+	else if (req->op == BUS_WRITE_AND_READ_REGISTERS)
+		batch->ret = do_write_read(conn, req);
+	else if (is_read(req->op)) {
+		if (req->next)
+			dbg("addr=%d merged read %d-%d",
+			    req->addr, batch->lo, batch->hi);
+		batch->ret = do_read(conn, req->op, req->addr, batch->lo,
+				     batch->hi - batch->lo + 1, batch->val);
+	} else
+		batch->ret = do_write(conn, req->op, req->addr, req->idx,
+				      req->nb, req->val);
+	batch->err = errno;
+	batch->lat = now_us() - t;
+}
+
+/* Split an executed batch's result back to its requests */
+static void finish_batch(struct modbusfs_conn_s *conn,
+			 struct modbusfs_batch_s *batch)
+{
+	struct modbusfs_req_s *req = batch->reqs;
+	uint64_t t;
+
+	if (is_read(req->op)) {
+		if (batch->ret == -1 && req->next &&
+		    is_exception(batch->err)) {
+			/*
+			 * The slave refused the whole range (maybe some
+			 * registers into the gap do not exist), so fall
+			 * back to one read per request.
+			 */
+			dbg("addr=%d merged read refused", req->addr);
+			for (; req; req = req->next) {
+				t = now_us();
+				req->ret = do_read(conn, req->op, req->addr,
+						   req->idx, req->nb, req->val);
+				req->err = errno;
+				t = now_us() - t;
+
+				STAT_ADD(conn->stats[req->addr].retries, 1);
+				account(conn, req->addr, req->op, req->nb,
+					req->ret, req->err, t, t);
+			}
+			return;
+		}
+
+		for (; req; req = req->next) {
+			req->ret = batch->ret == -1 ? -1 : req->nb;
+			req->err = batch->err;
+			if (batch->ret != -1)
+				memcpy(req->val, &batch->val[req->idx - batch->lo],
+				       sizeof(uint16_t) * req->nb);
+		}
+	} else {
+		req->ret = batch->ret;
+		req->err = batch->err;
+	}
+}
+
+/*
+ * Run the batches in order: consecutive batches that can be pipelined
+ * are sent all together, the others one at time. Pipelined batches
+ * share the bus time equally. Batches timed out before the full
+ * response timeout are retried alone.
+ */
+static void run_batches(struct modbusfs_conn_s *conn,
+			struct modbusfs_batch_s *batch, int n)
+{
+	struct modbusfs_batch_s *b;
+	uint64_t t;
+	int i, j;
+
+	for (i = 0; i < n; i = j) {
+		for (j = i; j < n && conn->depth > 1 &&
+			    tcp_can_pipeline(&batch[j]); j++)
+			;
+		t = now_us();
+		if (j - i > 1)
+			tcp_exec_batches(conn, &batch[i], j - i);
+		else {
+			exec_batch(conn, &batch[i]);
+			j = i + 1;
+		}
+		t = (now_us() - t) / (j - i);
+
+		for (; i < j; i++) {
+			b = &batch[i];
+			account(conn, b->reqs->addr, b->reqs->op,
+				is_read(b->reqs->op) ? b->hi - b->lo + 1 :
+						       b->reqs->nb,
+				b->ret, b->err, b->lat, t);
+
+			if (b->ret == -1 && b->err == ETIMEDOUT && b->retry) {
+				dbg("addr=%d timed out after %ums, retrying",
+				    b->reqs->addr, b->timeout);
+				b->timeout = conn->bus->timeout_max;
+				exec_batch(conn, b);
+
+				STAT_ADD(conn->stats[b->reqs->addr].retries, 1);
+				account(conn, b->reqs->addr, b->reqs->op,
+					is_read(b->reqs->op) ?
+						b->hi - b->lo + 1 : b->reqs->nb,
+					b->ret, b->err, b->lat, b->lat);
+			}
+
+			finish_batch(conn, b);
+		}
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct modbusfs_conn_s *conn = arg;
+	struct modbusfs_bus_s *bus = conn->bus;
+	struct modbusfs_batch_s *batch;
+	struct modbusfs_req_s *req, *next, *async;
+	int i, n;
+
+	batch = malloc(sizeof(*batch) * conn->depth);
+	EXIT_ON(!batch);
+
+	for (;;) {
+		bus_lock(bus);
+		while (!get_batch(conn, &batch[0]))
+			EXIT_ON(pthread_cond_wait(&bus->cond, &bus->mutex));
+		for (n = 1; n < conn->depth; n++)
+			if (!get_batch(conn, &batch[n]))
+				break;
+		EXIT_ON(pthread_mutex_unlock(&bus->mutex));
+
+		run_batches(conn, batch, n);
+
+		bus_lock(bus);
+		async = NULL;
+		for (i = 0; i < n; i++) {
+			update_slave(bus, &batch[i], &async);
+
+			req = batch[i].reqs;
+			if (!is_read(req->op))
+				bus->writing[req->addr]--;
+			if (--bus->inflight[req->addr] == 0) {
+				bus->owner[req->addr] = NULL;
+
+				/* Other connections may wait for the slave */
+				if (bus->conns_num > 1)
+					EXIT_ON(pthread_cond_broadcast(&bus->cond));
+			}
+
+			for (; req; req = next) {
+				next = req->next;
+				req_done(req, &async);
+			}
+		}
+		EXIT_ON(pthread_cond_broadcast(&bus->done_cond));
+		EXIT_ON(pthread_mutex_unlock(&bus->mutex));
+
+		complete_async(async);
+	}
+
+	return NULL;
+}
+
+/* Queue a request, must hold bus->mutex */
+static void queue_req(struct modbusfs_bus_s *bus, struct modbusfs_req_s *req)
+{
+	req->done = 0;
+	if (req->scan)
+		req->class = CLASS_BULK;
+	else if (!is_read(req->op))
+		req->class = CLASS_CONTROL;
+	else
+		req->class = req->bulk ? CLASS_BULK : CLASS_INTERACTIVE;
+	req->stamp = now_us();
+
+	req->seq = bus->seq++;
+	bus->stats[req->class].depth++;
+	enqueue(&bus->queue[req->class][req->addr], req);
+	EXIT_ON(pthread_cond_signal(&bus->cond));
+}
+
+/*
+ * Exported functions
+ */
+
+/* Max registers (or bits) a read can transfer */
+int bus_read_max(enum bus_op_e op)
+{
+	return is_bit_read(op) ? MODBUS_MAX_READ_BITS :
+				 MODBUS_MAX_READ_REGISTERS;
+}
+
+/* Bits are so cheap that the gap is counted in 16 bits words */
+int bus_read_gap(enum bus_op_e op)
+{
+	return is_bit_read(op) ? coalesce_gap * 16 : coalesce_gap;
+}
+
+/*
+ * Queue a request without waiting for its completion. Requests to a
+ * quarantined slave (but probes and scans), as well as reads from the
+ * broadcast address, fail at once, so the callback (if any) may be
+ * called before returning.
+ */
+void bus_submit(struct modbusfs_bus_s *bus, struct modbusfs_req_s *req)
+{
+	struct modbusfs_req_s *async = NULL;
+
+	bus_lock(bus);
+	if (bus->slaves[req->addr].quarantined &&
+	    !req->probe && !req->scan) {
+		req->ret = -1;
+		req->err = EIO;
+		req_done(req, &async);
+	} else if (is_broadcast(req->addr) && !can_broadcast(req->op)) {
+		req->ret = -1;
+		req->err = EINVAL;
+		req_done(req, &async);
+	} else
+		queue_req(bus, req);
+	EXIT_ON(pthread_mutex_unlock(&bus->mutex));
+
+	complete_async(async);
+}
+
+/* Wait for a submitted request and return its result */
+int bus_wait(struct modbusfs_bus_s *bus, struct modbusfs_req_s *req)
+{
+	bus_lock(bus);
+	while (!req->done)
+		EXIT_ON(pthread_cond_wait(&bus->done_cond, &bus->mutex));
+	EXIT_ON(pthread_mutex_unlock(&bus->mutex));
+
+	errno = req->err;
+	return req->ret;
+}
+
+/*
+ * Split a registers (or bits) range into requests of at most "max"
+ * items, as allowed by the function code, and queue them all at once
+ * so that they can be pipelined. The range fails as a whole if any
+ * request fails.
+ */
+static int bus_range(struct modbusfs_bus_s *bus, enum bus_op_e op,
+		     int addr, int idx, int nb, uint16_t *val, int max)
+{
+	/* Nothing to do, and no zero-length array below */
+	if (nb <= 0)
+		return 0;
+
+	int n = (nb + max - 1) / max;
+	struct modbusfs_req_s req[n];
+	int i, err = 0;
+	int ret = nb;
+
+	for (i = 0; i < n; i++) {
+		req[i] = (struct modbusfs_req_s) {
+			.op	= op,
+			.addr	= addr,
+			.idx	= idx + i * max,
+			.nb	= min(max, nb - i * max),
+			.val	= &val[i * max],
+		};
+		bus_submit(bus, &req[i]);
+	}
+
+	for (i = 0; i < n; i++)
+		if (bus_wait(bus, &req[i]) == -1 && ret != -1) {
+			ret = -1;
+			err = errno;
+		}
+
+	errno = err;
+	return ret;
+}
+
+/* Get a snapshot of the scheduler's statistics */
+void bus_sched_stats(struct modbusfs_bus_s *bus,
+		     struct modbusfs_class_stats_s *stats)
+{
+	bus_lock(bus);
+	memcpy(stats, bus->stats, sizeof(bus->stats));
+	EXIT_ON(pthread_mutex_unlock(&bus->mutex));
+}
+
+/*
+ * Sum up the statistics of a slave (or of all slaves if "addr" is -1)
+ * over all connections
+ */
+void bus_stats(struct modbusfs_bus_s *bus, int addr,
+	       struct modbusfs_stats_s *stats)
+{
+	struct modbusfs_stats_s *st;
+	int c, a, i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (c = 0; c < bus->conns_num; c++)
+		for (a = 0; a < CLIENTS_MAX; a++) {
+			if (addr >= 0 && a != addr)
+				continue;
+			st = &bus->conns[c].stats[a];
+
+			for (i = 0; i < BUS_OPS_NUM; i++)
+				stats->tx[i] += STAT_GET(st->tx[i]);
+			stats->timeouts += STAT_GET(st->timeouts);
+			stats->crc_errors += STAT_GET(st->crc_errors);
+			stats->exceptions += STAT_GET(st->exceptions);
+			stats->errors += STAT_GET(st->errors);
+			stats->retries += STAT_GET(st->retries);
+			stats->bytes_tx += STAT_GET(st->bytes_tx);
+			stats->bytes_rx += STAT_GET(st->bytes_rx);
+			stats->busy += STAT_GET(st->busy);
+			stats->lat_max = max(stats->lat_max,
+					     STAT_GET(st->lat_max));
+			for (i = 0; i < HIST_BUCKETS; i++)
+				stats->lat[i] += STAT_GET(st->lat[i]);
+		}
+}
+
+/* Get a snapshot of a slave's health */
+void bus_slave_health(struct modbusfs_bus_s *bus, int addr,
+		      struct modbusfs_slave_s *slave)
+{
+	bus_lock(bus);
+	*slave = bus->slaves[addr];
+	EXIT_ON(pthread_mutex_unlock(&bus->mutex));
+}
+
+/* Return the response timeout in ms of the next transaction to a slave */
+unsigned int bus_slave_timeout(const struct modbusfs_bus_s *bus,
+			       const struct modbusfs_slave_s *slave)
+{
+	unsigned int ms;
+
+	if (!slave->srtt || slave->quarantined)
+		return bus->timeout_max;
+
+	ms = (slave->srtt + 4 * slave->rttvar + 999) / 1000;
+	return min(max(ms, (unsigned int) TIMEOUT_MIN_MS), bus->timeout_max);
+}
+
+/*
+ * Queue a probe for each quarantined slave whose backoff time expired
+ * and update "next" with the next probe time. Any answer to the probe
+ * (a read of the first holding register) ends the quarantine.
+ */
+void bus_probe(struct modbusfs_bus_s *bus, uint64_t *next)
+{
+	struct modbusfs_slave_s *slave;
+	uint64_t now = now_ms();
+	int addr;
+
+	bus_lock(bus);
+	for (addr = 0; addr < CLIENTS_MAX; addr++) {
+		slave = &bus->slaves[addr];
+		if (!slave->quarantined || slave->probing)
+			continue;
+
+		if (slave->next_probe > now) {
+			*next = min(*next, slave->next_probe);
+			continue;
+		}
+
+		dbg("bus%d: probing slave %d", bus->id, addr);
+		slave->probe_req = (struct modbusfs_req_s) {
+			.op	= BUS_READ_REGISTERS,
+			.addr	= addr,
+			.idx	= 0,
+			.nb	= 1,
+			.val	= &slave->probe_val,
+			.bulk	= 1,
+			.probe	= 1,
+		};
+		slave->probing = 1;
+		queue_req(bus, &slave->probe_req);
+	}
+	EXIT_ON(pthread_mutex_unlock(&bus->mutex));
+}
+
+/*
+ * Return true if a transaction's result is an answer from the slave,
+ * even an exception or a corrupted one, but not a gateway's exception
+ * telling that the slave is missing
+ */
+int bus_answered(int ret, int err)
+{
+	if (ret != -1)
+		return 1;
+	if (err == EMBXGPATH || err == EMBXGTAR)
+		return 0;
+
+	return is_exception(err) || err == EMBBADCRC;
+}
+
+/* Return the p-th percentile of the latency in us */
+uint64_t bus_stats_percentile(const struct modbusfs_stats_s *stats, int p)
+{
+	unsigned long tot = 0, sum = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		tot += stats->lat[i];
+	if (tot == 0)
+		return 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += stats->lat[i];
+		if (sum * 100 >= tot * p)
+			break;
+	}
+
+	return min(hist_value(i), stats->lat_max);
+}
+
+int bus_read_registers(struct modbusfs_bus_s *bus,
+		       int addr, int idx, int nb, uint16_t *dest)
+{
+	return bus_range(bus, BUS_READ_REGISTERS, addr, idx, nb, dest,
+			 MODBUS_MAX_READ_REGISTERS);
+}
+
+/* Read any registers type, bits are returned as 0 or 1 values */
+int bus_read_table(struct modbusfs_bus_s *bus, enum reg_type_e type,
+		   int addr, int idx, int nb, uint16_t *dest)
+{
+	enum bus_op_e op = bus_read_op[type];
+
+	return bus_range(bus, op, addr, idx, nb, dest, bus_read_max(op));
+}
+
+static int bus_write_one(struct modbusfs_bus_s *bus, enum bus_op_e op,
+			 int addr, int idx, uint16_t val)
+{
+	struct modbusfs_req_s req = {
+		.op	= op,
+		.addr	= addr,
+		.idx	= idx,
+		.nb	= 1,
+		.val	= &val,
+	};
+
+	bus_submit(bus, &req);
+	return bus_wait(bus, &req);
+}
+
+int bus_write_register(struct modbusfs_bus_s *bus,
+		       int addr, int idx, uint16_t val)
+{
+	return bus_write_one(bus, BUS_WRITE_REGISTER, addr, idx, val);
+}
+
+int bus_write_coil(struct modbusfs_bus_s *bus,
+		   int addr, int idx, uint16_t val)
+{
+	return bus_write_one(bus, BUS_WRITE_COIL, addr, idx, val);
+}
+
+int bus_write_registers(struct modbusfs_bus_s *bus,
+			int addr, int idx, int nb, const uint16_t *src)
+{
+	/* Requests never modify the values to write */
+	return bus_range(bus, BUS_WRITE_REGISTERS, addr, idx, nb,
+			 (uint16_t *) src, MODBUS_MAX_WRITE_REGISTERS);
+}
+
+int bus_write_coils(struct modbusfs_bus_s *bus,
+		    int addr, int idx, int nb, const uint16_t *src)
+{
+	return bus_range(bus, BUS_WRITE_COILS, addr, idx, nb,
+			 (uint16_t *) src, MODBUS_MAX_WRITE_BITS);
+}
+
+/*
+ * Write "nb" registers from "idx" and then read "read_nb" registers
+ * from "read_idx" by one "Read/Write Multiple Registers" (FC23)
+ */
+int bus_write_and_read_registers(struct modbusfs_bus_s *bus, int addr,
+				 int idx, int nb, const uint16_t *src,
+				 int read_idx, int read_nb, uint16_t *dest)
+{
+	struct modbusfs_req_s req = {
+		.op		= BUS_WRITE_AND_READ_REGISTERS,
+		.addr		= addr,
+		.idx		= idx,
+		.nb		= nb,
+		.val		= (uint16_t *) src,
+		.read_idx	= read_idx,
+		.read_nb	= read_nb,
+		.dest		= dest,
+	};
+
+	bus_submit(bus, &req);
+	return bus_wait(bus, &req);
+}
+
+int bus_init(struct modbusfs_bus_s *bus, int id,
+	     modbus_t **ctx, int conns_num, int depth)
+{
+	pthread_condattr_t attr;
+	uint32_t sec, usec;
+	int c;
+
+	bus->id = id;
+
+	/* The configured response timeout is the adaptive timeouts' limit */
+	if (modbus_get_response_timeout(ctx[0], &sec, &usec) == -1)
+		bus->timeout_max = 500;
+	else
+		bus->timeout_max = sec * 1000 + usec / 1000;
+	memset(bus->slaves, 0, sizeof(bus->slaves));
+	bus->scan_buf = NULL;
+	bus->scan_len = 0;
+
+	bus->conns = calloc(conns_num, sizeof(struct modbusfs_conn_s));
+	if (!bus->conns)
+		return -ENOMEM;
+	bus->conns_num = conns_num;
+	for (c = 0; c < conns_num; c++) {
+		bus->conns[c].bus = bus;
+		bus->conns[c].ctx = ctx[c];
+		bus->conns[c].depth = depth;
+		bus->conns[c].tid = 0;
+		bus->conns[c].timeout = bus->timeout_max;
+
+		/* RTU has the slave address and the CRC, TCP the MBAP header */
+		if (modbus_get_header_length(ctx[c]) == 1)
+			bus->conns[c].adu_extra = 3;
+		else
+			bus->conns[c].adu_extra = modbus_get_header_length(ctx[c]);
+
+		bus->conns[c].stats = calloc(CLIENTS_MAX,
+					     sizeof(struct modbusfs_stats_s));
+		if (!bus->conns[c].stats)
+			return -ENOMEM;
+	}
+
+	memset(bus->queue, 0, sizeof(bus->queue));
+	memset(bus->rr, 0, sizeof(bus->rr));
+	memset(bus->skipped, 0, sizeof(bus->skipped));
+	memset(bus->stats, 0, sizeof(bus->stats));
+	bus->seq = 0;
+	bus->mutex_wait = 0;
+	bus->mutex_contended = 0;
+	EXIT_ON(pthread_mutex_init(&bus->mutex, NULL));
+	EXIT_ON(pthread_cond_init(&bus->cond, NULL));
+	EXIT_ON(pthread_cond_init(&bus->done_cond, NULL));
+
+	memset(bus->clients, 0, sizeof(bus->clients));
+	bus->clients_num = 0;
+	EXIT_ON(pthread_mutex_init(&bus->lock, NULL));
+
+	EXIT_ON(pthread_mutex_init(&bus->poll_mutex, NULL));
+	EXIT_ON(pthread_condattr_init(&attr));
+	EXIT_ON(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+	EXIT_ON(pthread_cond_init(&bus->poll_cond, &attr));
+	EXIT_ON(pthread_condattr_destroy(&attr));
+	bus->poll_kicked = 0;
+
+	return 0;
+}
+
+int bus_start(struct modbusfs_bus_s *bus)
+{
+	int c;
+	int ret;
+
+	bus->start = now_us();
+	for (c = 0; c < bus->conns_num; c++) {
+		ret = pthread_create(&bus->conns[c].worker, NULL,
+				     worker, &bus->conns[c]);
+		if (ret) {
+			err("cannot start bus worker: %s", strerror(ret));
+			return -ret;
+		}
+	}
+
+	return poller_start(bus);
+}
@@ -0,0 +1,382 @@
+/*
+ * Modbusfs clients & registers index
+ *
+ * Copyright (C) 2013-2014	Rodolfo Giometti <giometti@linux.it>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "modbusfs.h"
+
+/*
+ * Clients are directly indexed by their address into the bus's clients
+ * table while registers are directly indexed by their index into a two
+ * levels table per registers type: the register's index high byte
+ * selects a page of REGS_PAGE_SIZE registers (allocated on the first
+ * export) and the low byte selects the register inside it.
+ *
+ * Clients and registers pages are never freed nor moved, so pointers
+ * to them stay valid for the whole filesystem's life and lookups can be
+ * done without any locking; only adding (and removing) entries must be
+ * serialized by holding the bus's lock. Un-exported registers just
+ * clear their "exported" flag and are reused by the next export.
+ *
+ * A register's value spans its "nregs" registers, put together as an
+ * unsigned integer by following the register's words and bytes order
+ * (signed and floating point types are just reinterpreted).
+ *
+ * There is no room into the inode numbers for both a register's index
+ * and a bit number, so registers exported with a bits view get a handle
+ * on the bus (on the first export, and never released) which is used
+ * by the bits files' inode numbers instead.
+ */
+
+/*
+ * Local functions
+ */
+
+/* Must be called with the client's bus->lock held */
+static int bits_handle_alloc(struct modbusfs_register_s *reg)
+{
+	struct modbusfs_bus_s *bus = reg->cli->bus;
+	struct modbusfs_register_s **page;
+	int h = bus->bits_num;
+
+	if (h == REGS_PAGES * REGS_PAGE_SIZE)
+		return -ENOSPC;
+
+	page = bus->bits_regs[h / REGS_PAGE_SIZE];
+	if (!page) {
+		page = calloc(REGS_PAGE_SIZE, sizeof(*page));
+		if (!page)
+			return -ENOMEM;
+
+		__atomic_store_n(&bus->bits_regs[h / REGS_PAGE_SIZE], page,
+				 __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&page[h % REGS_PAGE_SIZE], reg, __ATOMIC_RELEASE);
+	bus->bits_num++;
+	reg->bits_handle = h + 1;
+
+	return 0;
+}
+
+/*
+ * Exported functions
+ */
+
+struct modbusfs_client_s *find_client(struct modbusfs_bus_s *bus, int addr)
+{
+	struct modbusfs_client_s *cli;
+
+	if (addr < 0 || addr >= CLIENTS_MAX)
+		return NULL;
+
+	cli = __atomic_load_n(&bus->clients[addr], __ATOMIC_ACQUIRE);
+	if (!cli || !__atomic_load_n(&cli->exported, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return cli;
+}
+
+/* Must be called with bus->lock held */
+int add_client(struct modbusfs_bus_s *bus, int addr, unsigned int mode,
+	       const struct modbusfs_cli_opts_s *opts)
+{
+	struct modbusfs_client_s *cli;
+	int ret;
+
+	if (addr < 0 || addr >= CLIENTS_MAX)
+		return -EINVAL;
+
+	cli = bus->clients[addr];
+	if (cli && cli->exported)
+		return -EEXIST;
+
+	if (!cli) {
+		cli = calloc(1, sizeof(struct modbusfs_client_s));
+		if (!cli)
+			return -ENOMEM;
+		cli->addr = addr;
+		cli->bus = bus;
+
+		__atomic_store_n(&bus->clients[addr], cli, __ATOMIC_RELEASE);
+	}
+	cli->mode = mode;
+
+	if (opts->linger) {
+		ret = wb_init(cli);
+		if (ret < 0)
+			return ret;
+	}
+	cli->linger = opts->linger;
+
+	__atomic_store_n(&cli->exported, 1, __ATOMIC_RELEASE);
+	bus->clients_num++;
+
+	return 0;
+}
+
+/* Return the first exported client after "cli" (or the first one) */
+struct modbusfs_client_s *next_client(struct modbusfs_bus_s *bus,
+				      struct modbusfs_client_s *cli)
+{
+	int addr;
+
+	for (addr = cli ? cli->addr + 1 : 0; addr < CLIENTS_MAX; addr++) {
+		cli = find_client(bus, addr);
+		if (cli)
+			return cli;
+	}
+
+	return NULL;
+}
+
+struct modbusfs_register_s *find_register(struct modbusfs_client_s *cli,
+					  enum reg_type_e type, int idx)
+{
+	struct modbusfs_register_s *page, *reg;
+
+	if (idx < 0 || idx >= REGS_PAGES * REGS_PAGE_SIZE)
+		return NULL;
+
+	page = __atomic_load_n(&cli->regs[type][idx / REGS_PAGE_SIZE],
+			       __ATOMIC_ACQUIRE);
+	if (!page)
+		return NULL;
+
+	reg = &page[idx % REGS_PAGE_SIZE];
+	if (!__atomic_load_n(&reg->exported, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return reg;
+}
+
+/* Must be called with the client's bus->lock held */
+int add_reg(struct modbusfs_client_s *cli, enum reg_type_e type,
+	    int idx, unsigned int mode,
+	    const struct modbusfs_reg_opts_s *opts)
+{
+	struct modbusfs_register_s *page, *reg;
+	int i;
+	int ret;
+
+	if (idx < 0 || idx >= REGS_PAGES * REGS_PAGE_SIZE)
+		return -EINVAL;
+
+	page = cli->regs[type][idx / REGS_PAGE_SIZE];
+	if (!page) {
+		page = calloc(REGS_PAGE_SIZE, sizeof(struct modbusfs_register_s));
+		if (!page)
+			return -ENOMEM;
+		for (i = 0; i < REGS_PAGE_SIZE; i++) {
+			page[i].type = type;
+			page[i].idx = (idx & ~(REGS_PAGE_SIZE - 1)) + i;
+			page[i].cli = cli;
+		}
+
+		__atomic_store_n(&cli->regs[type][idx / REGS_PAGE_SIZE], page,
+				 __ATOMIC_RELEASE);
+	}
+
+	reg = &page[idx % REGS_PAGE_SIZE];
+	if (reg->exported)
+		return -EEXIST;
+
+	if (opts->bits && !reg->bits_handle) {
+		ret = bits_handle_alloc(reg);
+		if (ret < 0)
+			return ret;
+	}
+
+	reg->mode = mode;
+	reg->ttl = opts->ttl;
+	reg->poll = opts->poll;
+	reg->fmt = opts->fmt;
+	reg->deadband = opts->deadband;
+	reg->dtype = opts->dtype;
+	reg->nregs = dtype_nregs(opts->dtype);
+	reg->words_le = opts->words_le;
+	reg->bytes_le = opts->bytes_le;
+	reg->bits = opts->bits;
+	reg->cache = 0;
+	reg->wide_stamp = 0;
+	reg->next_poll = 0;
+
+	__atomic_store_n(&reg->exported, 1, __ATOMIC_RELEASE);
+	cli->regs_num++;
+
+	return 0;
+}
+
+/* Must be called with the client's bus->lock held */
+int del_reg(struct modbusfs_client_s *cli, enum reg_type_e type, int idx)
+{
+	struct modbusfs_register_s *reg;
+
+	reg = find_register(cli, type, idx);
+	if (!reg)
+		return -ENOENT;
+
+	__atomic_store_n(&reg->exported, 0, __ATOMIC_RELEASE);
+	cli->regs_num--;
+
+	return 0;
+}
+
+/* Return the first exported register after "reg" (or the first one) */
+struct modbusfs_register_s *next_register(struct modbusfs_client_s *cli,
+					  enum reg_type_e type,
+					  struct modbusfs_register_s *reg)
+{
+	struct modbusfs_register_s *page;
+	int idx = reg ? reg->idx + 1 : 0;
+
+	while (idx < REGS_PAGES * REGS_PAGE_SIZE) {
+		page = __atomic_load_n(&cli->regs[type][idx / REGS_PAGE_SIZE],
+				       __ATOMIC_ACQUIRE);
+		if (!page) {
+			idx = (idx / REGS_PAGE_SIZE + 1) * REGS_PAGE_SIZE;
+			continue;
+		}
+
+		reg = &page[idx % REGS_PAGE_SIZE];
+		if (__atomic_load_n(&reg->exported, __ATOMIC_ACQUIRE))
+			return reg;
+		idx++;
+	}
+
+	return NULL;
+}
+
+/* Return the exported register owning a bits view handle */
+struct modbusfs_register_s *find_bits(struct modbusfs_bus_s *bus, int handle)
+{
+	struct modbusfs_register_s **page, *reg;
+
+	if (handle < 0 || handle >= REGS_PAGES * REGS_PAGE_SIZE)
+		return NULL;
+
+	page = __atomic_load_n(&bus->bits_regs[handle / REGS_PAGE_SIZE],
+			       __ATOMIC_ACQUIRE);
+	if (!page)
+		return NULL;
+
+	reg = __atomic_load_n(&page[handle % REGS_PAGE_SIZE],
+			      __ATOMIC_ACQUIRE);
+	if (!reg || !__atomic_load_n(&reg->exported, __ATOMIC_ACQUIRE) ||
+	    !reg->bits)
+		return NULL;
+
+	return reg;
+}
+
+/* Put the registers' words together into the register's value */
+uint64_t reg_value(const struct modbusfs_register_s *reg,
+		   const uint16_t *words)
+{
+	uint64_t val = 0;
+	uint16_t w;
+	int i;
+
+	for (i = 0; i < reg->nregs; i++) {
+		w = words[reg->words_le ? reg->nregs - 1 - i : i];
+		if (reg->bytes_le)
+			w = __builtin_bswap16(w);
+		val = val << 16 | w;
+	}
+
+	return val;
+}
+
+/* Split the register's value into its registers' words */
+void reg_words(const struct modbusfs_register_s *reg, uint64_t val,
+	       uint16_t *words)
+{
+	uint16_t w;
+	int i;
+
+	for (i = reg->nregs - 1; i >= 0; i--) {
+		w = val & 0xffff;
+		if (reg->bytes_le)
+			w = __builtin_bswap16(w);
+		words[reg->words_le ? reg->nregs - 1 - i : i] = w;
+		val >>= 16;
+	}
+}
+
+/*
+ * Store a value into the register's cache. Wider values writers are
+ * serialized by making the sequence odd, readers retry while it's odd
+ * or it changed.
+ */
+void reg_cache_store(struct modbusfs_register_s *reg, uint64_t val)
+{
+	unsigned int seq;
+
+	if (reg->nregs == 1) {
+		__atomic_store_n(&reg->cache, CACHE_PACK(now_ms(), val),
+				 __ATOMIC_RELAXED);
+		return;
+	}
+
+	do {
+		seq = __atomic_load_n(&reg->seq, __ATOMIC_RELAXED);
+	} while ((seq & 1) ||
+		 !__atomic_compare_exchange_n(&reg->seq, &seq, seq + 1, 0,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&reg->wide, val, __ATOMIC_RELAXED);
+	__atomic_store_n(&reg->wide_stamp, now_ms(), __ATOMIC_RELAXED);
+
+	__atomic_store_n(&reg->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Invalidate the register's cached value */
+void reg_cache_drop(struct modbusfs_register_s *reg)
+{
+	if (reg->nregs == 1)
+		__atomic_store_n(&reg->cache, 0, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(&reg->wide_stamp, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Load the register's cached value and return its timestamp in ms, or
+ * 0 if there is no valid value
+ */
+uint64_t reg_cache_load(struct modbusfs_register_s *reg, uint64_t *val)
+{
+	unsigned int seq;
+	uint64_t c, stamp;
+
+	if (reg->nregs == 1) {
+		c = __atomic_load_n(&reg->cache, __ATOMIC_RELAXED);
+		*val = CACHE_VAL(c);
+		return CACHE_STAMP(c);
+	}
+
+	do {
+		seq = __atomic_load_n(&reg->seq, __ATOMIC_ACQUIRE);
+		*val = __atomic_load_n(&reg->wide, __ATOMIC_RELAXED);
+		stamp = __atomic_load_n(&reg->wide_stamp, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) ||
+		 seq != __atomic_load_n(&reg->seq, __ATOMIC_RELAXED));
+
+	return stamp;
+}
@@ -19,400 +19,2798 @@
 
 #include "modbusfs.h"
 
-static modbus_t *ctx;
-static pthread_mutex_t ctx_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct modbusfs_bus_s *buses;
+static int buses_num;
+static struct fuse_chan *chan;
 
-static struct modbusfs_client_s *clients;
-static int clients_num;
+const char *map_file;
+
+/*
+ * The tree changes only when writing to the "exports" files and we
+ * explicitly invalidate the kernel's data then, so let it cache entries
+ * and attributes for a long time.
+ */
+#define ENTRY_TIMEOUT	3600.0
+#define ATTR_TIMEOUT	3600.0
+
+static const char *fmt_names[] = {
+	[FMT_HEX]	= "hex",
+	[FMT_DEC]	= "dec",
+	[FMT_LE]	= "le",
+	[FMT_BE]	= "be",
+};
+
+static const char *dtype_names[] = {
+	[DT_UINT16]	= "uint16",
+	[DT_INT16]	= "int16",
+	[DT_UINT32]	= "uint32",
+	[DT_INT32]	= "int32",
+	[DT_FLOAT32]	= "float32",
+	[DT_UINT64]	= "uint64",
+	[DT_INT64]	= "int64",
+	[DT_FLOAT64]	= "float64",
+};
+
+/* Max register file size of each type in decimal format */
+static const int dtype_dec_size[] = {
+	[DT_UINT16]	= 5,
+	[DT_INT16]	= 6,
+	[DT_UINT32]	= 10,
+	[DT_INT32]	= 11,
+	[DT_FLOAT32]	= 15,		/* "%.9g" */
+	[DT_UINT64]	= 20,
+	[DT_INT64]	= 20,
+	[DT_FLOAT64]	= 24,		/* "%.17g" */
+};
+
+/* Client's subdirectories holding the other registers types */
+static const char *table_dirs[] = {
+	[REG_INPUT]	= "input",
+	[REG_COIL]	= "coils",
+	[REG_DISCRETE]	= "discrete",
+};
+
+/* Registers types keywords into the map files */
+static const char *map_tables[] = {
+	[REG_HOLDING]	= "holding",
+	[REG_INPUT]	= "input",
+	[REG_COIL]	= "coils",
+	[REG_DISCRETE]	= "discrete",
+};
+
+/* Map file of each registers type */
+static const char *map_names[] = {
+	[REG_HOLDING]	= "regs",
+	[REG_INPUT]	= "regs",
+	[REG_COIL]	= "bits",
+	[REG_DISCRETE]	= "bits",
+};
 
 /*
  * Local functions
  */
 
-static int parse_path(char *path, char ***elem, size_t *num)
+static inline int elem_is(const char *str, size_t len, const char *name)
+{
+	return strlen(name) == len && memcmp(str, name, len) == 0;
+}
+
+/*
+ * Parse a name as a decimal number in 0-65535, return -1 if it's not
+ * valid (leading zeros are not allowed so that each register has just
+ * one name)
+ */
+static int elem_num(const char *str, size_t len)
+{
+	int val = 0;
+	size_t i;
+
+	if (len == 0 || len > 5 || (len > 1 && str[0] == '0'))
+		return -1;
+
+	for (i = 0; i < len; i++) {
+		if (!isdigit(str[i]))
+			return -1;
+		val = val * 10 + str[i] - '0';
+	}
+
+	return val <= 0xffff ? val : -1;
+}
+
+/* Return the table's type by the directory name or -1 */
+static int table_find(const char *name, size_t len)
+{
+	int t;
+
+	for (t = REG_INPUT; t < REG_TYPES_NUM; t++)
+		if (elem_is(name, len, table_dirs[t]))
+			return t;
+
+	return -1;
+}
+
+/* Return the inode number of a bus's root directory */
+static fuse_ino_t bus_ino(struct modbusfs_bus_s *bus)
+{
+	if (buses_num == 1)
+		return FUSE_ROOT_ID;
+
+	return INO(INO_BUS, bus->id, 0, 0);
+}
+
+static fuse_ino_t node_ino(const struct modbusfs_node_s *n)
+{
+	switch (n->type) {
+	case NODE_ROOT :
+		return n->bus ? bus_ino(n->bus) : FUSE_ROOT_ID;
+
+	case NODE_CLIENT :
+		return INO(INO_CLIENT, n->bus->id, n->cli->addr, 0);
+
+	case NODE_TABLE :
+		return INO(INO_TABLE, n->bus->id, n->cli->addr, n->table);
+
+	case NODE_REGISTER :
+		return INO(INO_REGISTER + n->reg->type, n->bus->id,
+			   n->cli->addr, n->reg->idx);
+
+	case NODE_BITS :
+		return INO(INO_BITS, n->bus->id, n->cli->addr, n->reg->idx);
+
+	case NODE_BIT :
+		return INO(INO_BIT, n->bus->id, n->bit, n->reg->bits_handle - 1);
+
+	case NODE_CTRL :
+		if (n->cli)
+			return INO(INO_CLIENT_CTRL, n->bus->id, n->cli->addr,
+				   n->table << 8 | n->ctrl_file);
+		if (!n->bus)
+			return INO(INO_ROOT, 0, 0, n->ctrl_file);
+		return INO(INO_BUS_CTRL, n->bus->id, 0, n->ctrl_file);
+
+	default :
+		BUG();
+	}
+}
+
+/*
+ * Rebuild a node from its inode number, return -ENOENT if the node
+ * doesn't exist (anymore).
+ */
+static int ino_node(fuse_ino_t ino, struct modbusfs_node_s *n)
+{
+	int id = INO_BUS_ID(ino);
+
+	n->type = NODE_ROOT;
+	n->bus = NULL;
+	n->cli = NULL;
+	n->table = REG_HOLDING;
+	n->reg = NULL;
+	n->bit = -1;
+	n->ctrl_file = CTRL_NONE;
+
+	if (ino == FUSE_ROOT_ID) {
+		if (buses_num == 1)
+			n->bus = &buses[0];
+		return 0;
+	}
+
+	/* The top directory's "scan" file of many buses */
+	if (ino == INO(INO_ROOT, 0, 0, CTRL_SCAN)) {
+		if (buses_num == 1)
+			return -ENOENT;
+		n->type = NODE_CTRL;
+		n->ctrl_file = CTRL_SCAN;
+		return 0;
+	}
+
+	if (id >= buses_num)
+		return -ENOENT;
+	n->bus = &buses[id];
+
+	switch (INO_KIND(ino)) {
+	case INO_BUS :
+		if (buses_num == 1)
+			return -ENOENT;
+		break;
+
+	case INO_BUS_CTRL :
+		if (INO_IDX(ino) != CTRL_EXPORTS &&
+		    INO_IDX(ino) != CTRL_CACHE && INO_IDX(ino) != CTRL_SCHED &&
+		    INO_IDX(ino) != CTRL_STATS && INO_IDX(ino) != CTRL_MAP &&
+		    INO_IDX(ino) != CTRL_SCAN)
+			return -ENOENT;
+		n->type = NODE_CTRL;
+		n->ctrl_file = INO_IDX(ino);
+		break;
+
+	case INO_CLIENT :
+	case INO_CLIENT_CTRL :
+	case INO_TABLE :
+	case INO_REGISTER ... INO_REGISTER_LAST :
+		n->cli = find_client(n->bus, INO_ADDR(ino));
+		if (!n->cli)
+			return -ENOENT;
+		n->type = NODE_CLIENT;
+
+		if (INO_KIND(ino) == INO_CLIENT_CTRL) {
+			n->table = INO_IDX(ino) >> 8;
+			n->ctrl_file = INO_IDX(ino) & 0xff;
+			if (n->table >= REG_TYPES_NUM)
+				return -ENOENT;
+			if (n->ctrl_file != CTRL_EXPORTS &&
+			    n->ctrl_file != CTRL_REGS &&
+			    ((n->ctrl_file != CTRL_STATS &&
+			      n->ctrl_file != CTRL_SNAPSHOT &&
+			      n->ctrl_file != CTRL_XFER) ||
+			     n->table != REG_HOLDING))
+				return -ENOENT;
+			n->type = NODE_CTRL;
+		} else if (INO_KIND(ino) == INO_TABLE) {
+			n->table = INO_IDX(ino);
+			if (n->table == REG_HOLDING ||
+			    n->table >= REG_TYPES_NUM)
+				return -ENOENT;
+			n->type = NODE_TABLE;
+		} else if (INO_KIND(ino) >= INO_REGISTER) {
+			n->table = INO_KIND(ino) - INO_REGISTER;
+			n->reg = find_register(n->cli, n->table, INO_IDX(ino));
+			if (!n->reg)
+				return -ENOENT;
+			n->type = NODE_REGISTER;
+		}
+		break;
+
+	case INO_BITS :
+		n->cli = find_client(n->bus, INO_ADDR(ino));
+		if (!n->cli)
+			return -ENOENT;
+		n->reg = find_register(n->cli, REG_HOLDING, INO_IDX(ino));
+		if (!n->reg || !n->reg->bits)
+			return -ENOENT;
+		n->type = NODE_BITS;
+		break;
+
+	case INO_BIT :
+		n->reg = find_bits(n->bus, INO_IDX(ino));
+		if (!n->reg || INO_ADDR(ino) > 15)
+			return -ENOENT;
+		n->cli = n->reg->cli;
+		if (find_client(n->bus, n->cli->addr) != n->cli)
+			return -ENOENT;
+		n->bit = INO_ADDR(ino);
+		n->type = NODE_BIT;
+		break;
+
+	default :
+		return -ENOENT;
+	}
+
+	return 0;
+}
+
+/*
+ * Move a directory node to its child called "name" by classifying the
+ * name according to its parent and parsing numbers in place. With more
+ * than one bus the top directory holds the "bus<n>" directories only,
+ * so it has a NULL bus.
+ */
+static int lookup_node(struct modbusfs_node_s *n, const char *name)
+{
+	size_t len = strlen(name);
+	int val;
+
+	switch (n->type) {
+	case NODE_ROOT :	/* /<bus|addr|ctrl> */
+		if (!n->bus) {
+			if (elem_is(name, len, "scan")) {
+				n->type = NODE_CTRL;
+				n->ctrl_file = CTRL_SCAN;
+				break;
+			}
+			if (len < 4 || memcmp(name, "bus", 3) != 0)
+				return -ENOENT;
+			val = elem_num(name + 3, len - 3);
+			if (val < 0 || val >= buses_num)
+				return -ENOENT;
+			n->bus = &buses[val];
+		} else if (elem_is(name, len, "exports")) {
+			n->type = NODE_CTRL;
+			n->ctrl_file = CTRL_EXPORTS;
+		} else if (elem_is(name, len, "cache")) {
+			n->type = NODE_CTRL;
+			n->ctrl_file = CTRL_CACHE;
+		} else if (elem_is(name, len, "sched")) {
+			n->type = NODE_CTRL;
+			n->ctrl_file = CTRL_SCHED;
+		} else if (elem_is(name, len, "stats")) {
+			n->type = NODE_CTRL;
+			n->ctrl_file = CTRL_STATS;
+		} else if (elem_is(name, len, "map")) {
+			n->type = NODE_CTRL;
+			n->ctrl_file = CTRL_MAP;
+		} else if (elem_is(name, len, "scan")) {
+			n->type = NODE_CTRL;
+			n->ctrl_file = CTRL_SCAN;
+		} else {
+			n->cli = find_client(n->bus, elem_num(name, len));
+			if (!n->cli)
+				return -ENOENT;
+			n->type = NODE_CLIENT;
+		}
+		break;
+
+	case NODE_CLIENT :	/* /<addr>/<reg|table|ctrl> */
+	case NODE_TABLE :	/* /<addr>/<table>/<reg|ctrl> */
+		if (elem_is(name, len, "exports")) {
+			n->type = NODE_CTRL;
+			n->ctrl_file = CTRL_EXPORTS;
+		} else if (elem_is(name, len, map_names[n->table])) {
+			n->type = NODE_CTRL;
+			n->ctrl_file = CTRL_REGS;
+		} else if (n->type == NODE_CLIENT &&
+			   elem_is(name, len, "stats")) {
+			n->type = NODE_CTRL;
+			n->ctrl_file = CTRL_STATS;
+		} else if (n->type == NODE_CLIENT &&
+			   elem_is(name, len, "snapshot")) {
+			n->type = NODE_CTRL;
+			n->ctrl_file = CTRL_SNAPSHOT;
+		} else if (n->type == NODE_CLIENT &&
+			   elem_is(name, len, "xfer")) {
+			n->type = NODE_CTRL;
+			n->ctrl_file = CTRL_XFER;
+		} else if (n->type == NODE_CLIENT && len > 5 &&
+			   memcmp(name + len - 5, ".bits", 5) == 0) {
+			n->reg = find_register(n->cli, REG_HOLDING,
+					       elem_num(name, len - 5));
+			if (!n->reg || !n->reg->bits)
+				return -ENOENT;
+			n->type = NODE_BITS;
+		} else if (n->type == NODE_CLIENT &&
+			   (val = table_find(name, len)) >= 0) {
+			n->type = NODE_TABLE;
+			n->table = val;
+		} else {
+			n->reg = find_register(n->cli, n->table,
+					       elem_num(name, len));
+			if (!n->reg)
+				return -ENOENT;
+			n->type = NODE_REGISTER;
+		}
+		break;
+
+	case NODE_BITS :	/* /<addr>/<reg>.bits/<bit> */
+		val = elem_num(name, len);
+		if (val < 0 || val > 15)
+			return -ENOENT;
+		n->bit = val;
+		n->type = NODE_BIT;
+		break;
+
+	default :		/* files have no children */
+		return -ENOTDIR;
+	}
+
+	return 0;
+}
+
+/* Return the file mode of a table's map file */
+static mode_t map_mode(struct modbusfs_client_s *cli, enum reg_type_e table)
+{
+	mode_t mode = cli->mode & MODE_REG_MASK;
+
+	if (reg_type_is_ro(table))
+		mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+	if (is_broadcast(cli->addr))
+		mode &= ~(S_IRUSR | S_IRGRP | S_IROTH);
+
+	return mode;
+}
+
+/* Max register file size */
+static int value_size(const struct modbusfs_register_s *reg)
+{
+	switch (reg->fmt) {
+	case FMT_HEX :
+		return reg->nregs * 4;
+
+	case FMT_DEC :
+		return dtype_dec_size[reg->dtype];
+
+	default :
+		return reg->nregs * 2;
+	}
+}
+
+/* Return the bits of a value of "nregs" registers */
+static uint64_t value_mask(int nregs)
+{
+	return nregs == 4 ? UINT64_MAX : (1ULL << (nregs * 16)) - 1;
+}
+
+static void node_stat(const struct modbusfs_node_s *n, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = node_ino(n);
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+
+	switch (n->type) {
+	case NODE_ROOT :	/* / */
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+
+		break;
+
+	case NODE_CLIENT :	/* /<addr> */
+		stbuf->st_mode = S_IFDIR | n->cli->mode;
+		stbuf->st_nlink = 2 + REG_TYPES_NUM - 1;	/* tables */
+
+		break;
+
+	case NODE_TABLE :	/* /<addr>/<table> */
+		stbuf->st_mode = S_IFDIR | n->cli->mode;
+		stbuf->st_nlink = 2;
+
+		break;
+
+	case NODE_REGISTER :	/* /<addr>[/<table>]/<reg> */
+		stbuf->st_mode = S_IFREG | n->reg->mode;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = value_size(n->reg);
+
+		break;
+
+	case NODE_BITS :	/* /<addr>/<reg>.bits */
+		stbuf->st_mode = S_IFDIR | n->cli->mode;
+		stbuf->st_nlink = 2;
+
+		break;
+
+	case NODE_BIT :		/* /<addr>/<reg>.bits/<bit> */
+		stbuf->st_mode = S_IFREG | n->reg->mode;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = 1;
+
+		break;
+
+	case NODE_CTRL :	/* [/<addr>[/<table>]]/<ctrl> */
+		stbuf->st_nlink = 1;
+		stbuf->st_size = 0;
+
+		switch (n->ctrl_file) {
+		case CTRL_EXPORTS :
+			stbuf->st_mode = S_IFREG | S_IWUSR;	/* write only! */
+			break;
+
+		case CTRL_CACHE :
+		case CTRL_SCHED :
+		case CTRL_STATS :
+		case CTRL_MAP :
+			stbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+			break;
+
+		case CTRL_SCAN :
+			stbuf->st_mode = S_IFREG | S_IRUSR | S_IWUSR |
+					 S_IRGRP | S_IROTH;
+			break;
+
+		case CTRL_SNAPSHOT :
+			stbuf->st_mode = S_IFREG |
+					 (map_mode(n->cli, REG_HOLDING) &
+					  (S_IRUSR | S_IRGRP | S_IROTH));
+			break;
+
+		case CTRL_XFER :
+			stbuf->st_mode = S_IFREG | map_mode(n->cli, REG_HOLDING);
+			break;
+
+		case CTRL_REGS :
+			stbuf->st_mode = S_IFREG | map_mode(n->cli, n->table);
+			stbuf->st_size = reg_type_is_bit(n->table) ?
+					 BITS_FILE_SIZE : REGS_FILE_SIZE;
+			break;
+
+		default :
+			BUG();
+		}
+
+		break;
+
+	default :
+		BUG();
+	}
+}
+
+/*
+ * Tell the kernel that a directory's content changed. Errors are not
+ * fatal: old kernels don't support notifications and, at worst, the
+ * kernel keeps using the old data until the timeouts expire.
+ */
+static void notify_dir_changed(fuse_ino_t ino)
+{
+	int ret;
+
+	if (!chan)
+		return;
+
+	ret = fuse_lowlevel_notify_inval_inode(chan, ino, 0, 0);
+	if (ret < 0 && ret != -ENOENT)
+		dbg("cannot invalidate inode %lx: %s", ino, strerror(-ret));
+}
+
+/* Parse a time as "<n>[ms|s]" (milliseconds if no unit is given) */
+static int parse_time(const char *str, unsigned int *ms)
+{
+	unsigned int val;
+	char unit[3] = "";
+	int ret;
+
+	ret = sscanf(str, "%u%2s", &val, unit);
+	if (ret < 1)
+		return -1;
+
+	if (ret == 1 || strcmp(unit, "ms") == 0)
+		*ms = val;
+	else if (strcmp(unit, "s") == 0)
+		*ms = val * 1000;
+	else
+		return -1;
+
+	return 0;
+}
+
+static int parse_fmt(const char *str, enum reg_fmt_e *fmt)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(fmt_names); i++)
+		if (strcmp(str, fmt_names[i]) == 0) {
+			*fmt = i;
+			return 0;
+		}
+
+	return -1;
+}
+
+static int parse_dtype(const char *str, enum reg_dtype_e *dtype)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(dtype_names); i++)
+		if (strcmp(str, dtype_names[i]) == 0) {
+			*dtype = i;
+			return 0;
+		}
+
+	return -1;
+}
+
+/* Parse a words or bytes order as "be" or "le" */
+static int parse_order(const char *str, int *le)
+{
+	if (strcmp(str, "be") == 0)
+		*le = 0;
+	else if (strcmp(str, "le") == 0)
+		*le = 1;
+	else
+		return -1;
+
+	return 0;
+}
+
+static enum reg_fmt_e default_fmt(enum reg_dtype_e dtype)
+{
+	return dtype == DT_UINT16 ? FMT_HEX : FMT_DEC;
+}
+
+/*
+ * Parse the register's exports options, that is an optional cache
+ * max age followed by "<name>=<value>" settings.
+ */
+static int parse_reg_opts(char *str, struct modbusfs_reg_opts_s *opts)
+{
+	char *tok, *env;
+	int fmt_set = 0;
+
+	memset(opts, 0, sizeof(*opts));
+	opts->fmt = FMT_HEX;
+	opts->dtype = DT_UINT16;
+
+	tok = strtok_r(str, " \t\n", &env);
+	if (tok && isdigit(*tok)) {
+		if (parse_time(tok, &opts->ttl) < 0)
+			return -1;
+		tok = strtok_r(NULL, " \t\n", &env);
+	}
+
+	while (tok) {
+		if (strncmp(tok, "poll=", 5) == 0) {
+			if (parse_time(tok + 5, &opts->poll) < 0)
+				return -1;
+		} else if (strncmp(tok, "fmt=", 4) == 0) {
+			if (parse_fmt(tok + 4, &opts->fmt) < 0)
+				return -1;
+			fmt_set = 1;
+		} else if (strncmp(tok, "deadband=", 9) == 0) {
+			if (sscanf(tok + 9, "%u", &opts->deadband) != 1)
+				return -1;
+		} else if (strncmp(tok, "type=", 5) == 0) {
+			if (parse_dtype(tok + 5, &opts->dtype) < 0)
+				return -1;
+		} else if (strncmp(tok, "words=", 6) == 0) {
+			if (parse_order(tok + 6, &opts->words_le) < 0)
+				return -1;
+		} else if (strncmp(tok, "bytes=", 6) == 0) {
+			if (parse_order(tok + 6, &opts->bytes_le) < 0)
+				return -1;
+		} else if (strcmp(tok, "bits") == 0)
+			opts->bits = 1;
+		else
+			return -1;
+
+		tok = strtok_r(NULL, " \t\n", &env);
+	}
+
+	/* Typed values are decimal numbers by default */
+	if (!fmt_set)
+		opts->fmt = default_fmt(opts->dtype);
+	if (opts->fmt == FMT_HEX && dtype_is_float(opts->dtype))
+		return -1;
+
+	return 0;
+}
+
+/* Parse the client's exports options as "<name>=<value>" settings */
+static int parse_cli_opts(char *str, struct modbusfs_cli_opts_s *opts)
+{
+	char *tok, *env;
+
+	memset(opts, 0, sizeof(*opts));
+
+	for (tok = strtok_r(str, " \t\n", &env); tok;
+	     tok = strtok_r(NULL, " \t\n", &env)) {
+		if (strncmp(tok, "linger=", 7) == 0) {
+			if (parse_time(tok + 7, &opts->linger) < 0)
+				return -1;
+		} else
+			return -1;
+	}
+
+	return 0;
+}
+
+/* An entry written into an exports file */
+struct modbusfs_export_s {
+	int del;			/* un-export */
+	int first, last, step;		/* the clients' or registers' range */
+	unsigned int mode;
+	struct modbusfs_reg_opts_s reg_opts;
+	struct modbusfs_cli_opts_s cli_opts;
+	unsigned int timeout;		/* scan probes' timeout */
+};
+
+/*
+ * Parse an exports entry as "[-]<first>[-<last>[/<step>]]" and return
+ * the number of parsed chars or -1. A leading "-" asks for un-exporting.
+ */
+static int parse_range(const char *str, struct modbusfs_export_s *e)
+{
+	const char *ptr = str;
+	int n;
+
+	e->del = *ptr == '-';
+	if (e->del)
+		ptr++;
+
+	if (!isdigit(*ptr) || sscanf(ptr, "%d%n", &e->first, &n) != 1)
+		return -1;
+	ptr += n;
+	e->last = e->first;
+	e->step = 1;
+
+	if (*ptr == '-') {
+		if (!isdigit(ptr[1]) || sscanf(ptr + 1, "%d%n", &e->last, &n) != 1)
+			return -1;
+		ptr += n + 1;
+
+		if (*ptr == '/') {
+			if (!isdigit(ptr[1]) ||
+			    sscanf(ptr + 1, "%d%n", &e->step, &n) != 1)
+				return -1;
+			ptr += n + 1;
+		}
+	}
+	if (*ptr && !isspace(*ptr))
+		return -1;
+	if (e->last < e->first || e->step < 1)
+		return -1;
+
+	return ptr - str;
+}
+
+/*
+ * Parse the entries, one per line, written into an exports file. An
+ * entry is a range followed by the files permissions and the options
+ * (as parsed by "parse_opts") or, for un-exporting, the range only.
+ * Return the number of entries or -1.
+ */
+static int parse_exports(char *str, struct modbusfs_export_s **entries,
+			 int (*parse_opts)(char *str,
+					   struct modbusfs_export_s *e))
+{
+	struct modbusfs_export_s *e;
+	char *line, *env;
+	int n = 1, i = 0;
+	int ret;
+
+	for (line = str; (line = strchr(line, '\n')); line++)
+		n++;
+	e = calloc(n, sizeof(*e));
+	if (!e)
+		return -1;
+
+	for (line = strtok_r(str, "\n", &env); line;
+	     line = strtok_r(NULL, "\n", &env)) {
+		while (isspace(*line))
+			line++;
+		if (!*line)
+			continue;
+
+		ret = parse_range(line, &e[i]);
+		if (ret < 0)
+			goto error;
+		line += ret;
+
+		if (e[i].del) {
+			while (isspace(*line))
+				line++;
+			if (*line)
+				goto error;
+		} else {
+			if (sscanf(line, "%o %n", &e[i].mode, &ret) != 1)
+				goto error;
+			if (parse_opts(line + ret, &e[i]) < 0)
+				goto error;
+		}
+		i++;
+	}
+
+	*entries = e;
+	return i;
+
+error:
+	free(e);
+	return -1;
+}
+
+static int parse_reg_entry(char *str, struct modbusfs_export_s *e)
+{
+	return parse_reg_opts(str, &e->reg_opts);
+}
+
+static int parse_cli_entry(char *str, struct modbusfs_export_s *e)
+{
+	return parse_cli_opts(str, &e->cli_opts);
+}
+
+/* Parse the scan's optional probes timeout */
+static int parse_scan_entry(char *str, struct modbusfs_export_s *e)
+{
+	char *tok, *env;
+
+	e->timeout = SCAN_TIMEOUT_DEF;
+
+	tok = strtok_r(str, " \t\n", &env);
+	if (!tok)
+		return 0;
+	if (parse_time(tok, &e->timeout) < 0 || e->timeout == 0)
+		return -1;
+
+	return strtok_r(NULL, " \t\n", &env) ? -1 : 0;
+}
+
+/*
+ * Convert a register value into the register's file format, "buf" must
+ * hold at least 32 chars
+ */
+static int format_value(struct modbusfs_register_s *reg, uint64_t val,
+			char *buf)
+{
+	int n = reg->nregs * 2;
+	uint32_t u32;
+	float f;
+	double d;
+	int i;
+
+	switch (reg->fmt) {
+	case FMT_HEX :
+		return sprintf(buf, "%llx", (unsigned long long) val);
+
+	case FMT_DEC :
+		switch (reg->dtype) {
+		case DT_INT16 :
+			return sprintf(buf, "%d", (int16_t) val);
+
+		case DT_INT32 :
+			return sprintf(buf, "%d", (int32_t) val);
+
+		case DT_INT64 :
+			return sprintf(buf, "%lld", (long long) (int64_t) val);
+
+		case DT_FLOAT32 :
+			u32 = val;
+			memcpy(&f, &u32, sizeof(f));
+			return sprintf(buf, "%.9g", f);
+
+		case DT_FLOAT64 :
+			memcpy(&d, &val, sizeof(d));
+			return sprintf(buf, "%.17g", d);
+
+		default :
+			return sprintf(buf, "%llu", (unsigned long long) val);
+		}
+
+	case FMT_LE :
+		for (i = 0; i < n; i++)
+			buf[i] = val >> (8 * i);
+		return n;
+
+	case FMT_BE :
+		for (i = 0; i < n; i++)
+			buf[i] = val >> (8 * (n - 1 - i));
+		return n;
+
+	default :
+		BUG();
+	}
+}
+
+/* Convert the user data into a register value */
+static int parse_value(struct modbusfs_register_s *reg,
+		       const char *buf, size_t size, uint64_t *val)
+{
+	uint64_t mask = value_mask(reg->nregs);
+	int n = reg->nregs * 2;
+	unsigned long long u;
+	long long l;
+	uint32_t u32;
+	float f;
+	double d;
+	char *str;
+	int i;
+
+	switch (reg->fmt) {
+	case FMT_HEX :
+	case FMT_DEC :
+		/* User data are not NUL terminated */
+		str = strndupa(buf, min(size, (size_t) 64));
+		break;
+
+	case FMT_LE :
+	case FMT_BE :
+		if (size != n)
+			return -1;
+		*val = 0;
+		for (i = 0; i < n; i++)
+			*val |= (uint64_t) (uint8_t) buf[i] <<
+				(8 * (reg->fmt == FMT_LE ? i : n - 1 - i));
+		return 0;
+
+	default :
+		BUG();
+	}
+
+	if (reg->fmt == FMT_HEX) {
+		if (sscanf(str, "%llx", &u) != 1 || (u & ~mask))
+			return -1;
+		*val = u;
+		return 0;
+	}
+
+	switch (reg->dtype) {
+	case DT_INT16 :
+	case DT_INT32 :
+	case DT_INT64 :
+		if (sscanf(str, "%lld", &l) != 1)
+			return -1;
+		if (reg->nregs < 4 && (l < -(long long) (mask / 2) - 1 ||
+				       l > (long long) (mask / 2)))
+			return -1;
+		*val = (uint64_t) l & mask;
+		return 0;
+
+	case DT_FLOAT32 :
+		if (sscanf(str, "%f", &f) != 1)
+			return -1;
+		memcpy(&u32, &f, sizeof(u32));
+		*val = u32;
+		return 0;
+
+	case DT_FLOAT64 :
+		if (sscanf(str, "%lf", &d) != 1)
+			return -1;
+		memcpy(val, &d, sizeof(*val));
+		return 0;
+
+	default :
+		if (sscanf(str, "%llu", &u) != 1 || (u & ~mask))
+			return -1;
+		*val = u;
+		return 0;
+	}
+}
+
+/*
+ * Return true if the user data are a masked write, that is "&<and>",
+ * "|<or>" or both, of a register holding a text value
+ */
+static int is_masked_write(struct modbusfs_register_s *reg,
+			   const char *buf, size_t size)
+{
+	return reg->type == REG_HOLDING && reg->nregs == 1 &&
+	       (reg->fmt == FMT_HEX || reg->fmt == FMT_DEC) &&
+	       size > 0 && (buf[0] == '&' || buf[0] == '|');
+}
+
+/*
+ * Convert a masked write, or a bits file's "0" or "1", into the AND and
+ * OR masks of "Mask Write Register" (FC22) which sets the register to
+ * (value & and) | (or & ~and). A missing AND mask is ~or, so "|<or>"
+ * sets bits, while a missing OR mask is 0, so "&<and>" clears them.
+ */
+static int parse_masks(struct modbusfs_data_s *data, const char *buf,
+		       size_t size, uint16_t *masks)
+{
+	const char *fmt = data->reg->fmt == FMT_DEC ? "%u%n" : "%x%n";
+	unsigned int and = 0xffff, or = 0;
+	char *str;
+	int n;
+
+	/* User data are not NUL terminated */
+	str = strndupa(buf, min(size, (size_t) 64));
+
+	if (data->bit >= 0) {
+		if (!isdigit(*str) || sscanf(str, "%u%n", &or, &n) != 1 ||
+		    or > 1)
+			return -1;
+		str += n;
+		and = ~(1U << data->bit);
+		or <<= data->bit;
+	} else {
+		if (*str == '&') {
+			if (!isxdigit(str[1]) ||
+			    sscanf(str + 1, fmt, &and, &n) != 1 || and > 0xffff)
+				return -1;
+			str += n + 1;
+		}
+		if (*str == '|') {
+			if (!isxdigit(str[1]) ||
+			    sscanf(str + 1, fmt, &or, &n) != 1 || or > 0xffff)
+				return -1;
+			if (buf[0] == '|')
+				and = ~or;
+			str += n + 1;
+		}
+	}
+	if (str[strspn(str, " \t\n")])
+		return -1;
+
+	/* Masks apply to the register's value, the slave gets its word */
+	masks[0] = and;
+	masks[1] = or;
+	if (data->reg->bytes_le) {
+		masks[0] = __builtin_bswap16(masks[0]);
+		masks[1] = __builtin_bswap16(masks[1]);
+	}
+
+	return 0;
+}
+
+/* TODO: we should check group & other permissions too */
+static int have_permissions(int flags, int mode)
+{
+	flags &= O_ACCMODE;
+
+	if (flags != O_WRONLY && !(mode & S_IRUSR))
+		return 0;
+	if (flags != O_RDONLY && !(mode & S_IWUSR))
+		return 0;
+
+	return 1;	/* ok */
+}
+
+/*
+ * Look up a register value into the write-behind queue and then into
+ * the cache, where it's valid if not older than the register's TTL.
+ * Polled registers are always served from their shadow value unless
+ * the poller failed to read them or "fresh" is set. Return 1 if found.
+ */
+static int cache_lookup(struct modbusfs_register_s *reg, uint64_t *val,
+			int fresh)
+{
+	struct modbusfs_client_s *cli = reg->cli;
+	uint64_t stamp, now;
+	uint16_t w;
+
+	/* Not yet written values are the most recent ones */
+	if (reg->type == REG_HOLDING && cli->linger && reg->nregs == 1 &&
+	    wb_lookup(cli, reg->idx, &w)) {
+		*val = reg_value(reg, &w);
+		return 1;
+	}
+
+	if (reg->poll && !fresh) {
+		if (reg_cache_load(reg, val))
+			return 1;
+	} else if (reg->ttl && !fresh) {
+		now = now_ms();
+		stamp = reg_cache_load(reg, val);
+		if (stamp && now - stamp < reg->ttl) {
+			__atomic_add_fetch(&cli->cache_hits, 1,
+					   __ATOMIC_RELAXED);
+			return 1;
+		}
+		__atomic_add_fetch(&cli->cache_misses, 1, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+static void cache_store(struct modbusfs_register_s *reg, uint64_t val)
+{
+	if (reg->ttl || reg->poll)
+		reg_cache_store(reg, val);
+}
+
+/*
+ * Register files accesses going to the bus are completed by the bus
+ * worker, which sends the reply to the kernel by itself, so FUSE
+ * threads never wait for the bus. Values wider than one register are
+ * read (or written) by one single transaction, so they are never torn.
+ */
+struct modbusfs_areq_s {
+	struct modbusfs_req_s breq;
+	fuse_req_t req;
+	struct modbusfs_data_s *data;
+	size_t size;			/* written bytes */
+	uint16_t val[4];
+};
+
+/* Convert a register value into the register's or bits file format */
+static int format_file(struct modbusfs_data_s *data, uint64_t val, char *buf)
+{
+	if (data->bit >= 0)
+		return sprintf(buf, "%d", (int) (val >> data->bit) & 1);
+
+	return format_value(data->reg, val, buf);
+}
+
+static void reg_done(struct modbusfs_req_s *breq)
+{
+	struct modbusfs_areq_s *a = breq->priv;
+	struct modbusfs_register_s *reg = a->data->reg;
+	int is_read = breq->op == bus_read_op[reg->type];
+	uint64_t val;
+	char buf[32];
+
+	/* We don't know the register's status after a failed write */
+	if (breq->ret == -1) {
+		dbg("addr=%d idx=%d failed: %s", breq->addr, breq->idx,
+		    modbus_strerror(breq->err));
+
+		if (!is_read)
+			reg_cache_drop(reg);
+
+		fuse_reply_err(a->req, EIO);
+		free(a);
+		return;
+	}
+
+	/* Nor after a masked write, the new value depends on the old one */
+	if (breq->op == BUS_MASK_WRITE_REGISTER) {
+		reg_cache_drop(reg);
+
+		fuse_reply_write(a->req, a->size);
+		free(a);
+		return;
+	}
+
+	val = reg_value(reg, a->val);
+	cache_store(reg, val);
+	if (is_read) {
+		a->data->seen = val;
+		a->data->seen_valid = 1;
+
+		fuse_reply_buf(a->req, buf, format_file(a->data, val, buf));
+	} else
+		fuse_reply_write(a->req, a->size);
+	free(a);
+}
+
+/* Submit a register file access, "words" are the values to write */
+static int reg_submit(fuse_req_t req, struct modbusfs_data_s *data,
+		      enum bus_op_e op, const uint16_t *words, size_t size)
+{
+	struct modbusfs_areq_s *a;
+
+	a = malloc(sizeof(*a));
+	if (!a)
+		return -ENOMEM;
+	a->req = req;
+	a->data = data;
+	a->size = size;
+	if (words)
+		memcpy(a->val, words, sizeof(a->val));
+	a->breq = (struct modbusfs_req_s) {
+		.op		= op,
+		.addr		= data->cli->addr,
+		.idx		= data->reg->idx,
+		.nb		= data->reg->nregs,
+		.val		= a->val,
+		.callback	= reg_done,
+		.priv		= a,
+	};
+
+	bus_submit(data->bus, &a->breq);
+
+	return 0;
+}
+
+static void reg_read(fuse_req_t req, struct modbusfs_data_s *data,
+		     size_t size, off_t offset)
+{
+	struct modbusfs_register_s *reg = data->reg;
+	uint64_t val;
+	char buf[32];
+	int ret;
+
+	dbg("addr=%d idx=%d", data->cli->addr, reg->idx);
+
+	/* Read register content only at first read! */
+	if (offset != 0) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	if (size < (data->bit < 0 ? value_size(reg) : 1)) {
+		fuse_reply_err(req, EIO);
+		return;
+	}
+
+	if (cache_lookup(reg, &val, data->fresh)) {
+		data->seen = val;
+		data->seen_valid = 1;
+
+		fuse_reply_buf(req, buf, format_file(data, val, buf));
+		return;
+	}
+
+	ret = reg_submit(req, data, bus_read_op[reg->type], NULL, 0);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+}
+
+/*
+ * Write a register file, clients in write-behind mode just queue the
+ * value unless the file has been opened with O_SYNC. Values wider than
+ * one register are never queued, they are written by one "Write
+ * Multiple Registers" (FC16) after flushing the queue, and so are bits
+ * files and masked writes by one "Mask Write Register" (FC22).
+ */
+static void reg_write(fuse_req_t req, struct modbusfs_data_s *data,
+		      const char *buf, size_t size)
+{
+	struct modbusfs_register_s *reg = data->reg;
+	struct modbusfs_client_s *cli = data->cli;
+	enum bus_op_e op;
+	uint16_t words[4];
+	uint64_t val;
+	int ret;
+
+	dbg("addr=%d idx=%d bit=%d", cli->addr, reg->idx, data->bit);
+
+	if (data->bit >= 0 || is_masked_write(reg, buf, size)) {
+		ret = parse_masks(data, buf, size, words);
+		if (ret < 0 || is_broadcast(cli->addr)) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		dbg("and=%04x or=%04x", words[0], words[1]);
+
+		op = BUS_MASK_WRITE_REGISTER;
+		goto flush;
+	}
+
+	/* Read user data */
+	ret = parse_value(reg, buf, size, &val);
+	if (ret < 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (reg_type_is_bit(reg->type) && val > 1) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	dbg("val=%llx", (unsigned long long) val);
+
+	reg_words(reg, val, words);
+
+	if (reg->type == REG_HOLDING && cli->linger && reg->nregs == 1) {
+		ret = wb_write(cli, reg->idx, words[0]);
+		if (ret == 0 && data->fresh)
+			ret = wb_flush(cli);
+		if (ret < 0)
+			fuse_reply_err(req, EIO);
+		else
+			fuse_reply_write(req, size);
+		return;
+	}
+
+	if (reg->type == REG_COIL)
+		op = BUS_WRITE_COIL;
+	else if (reg->nregs > 1)
+		op = BUS_WRITE_REGISTERS;
+	else
+		op = BUS_WRITE_REGISTER;
+
+flush:
+	/* Queued writes must not overwrite the new value later */
+	if (reg->type == REG_HOLDING && cli->linger) {
+		ret = wb_flush(cli);
+		if (ret < 0) {
+			fuse_reply_err(req, EIO);
+			return;
+		}
+	}
+
+	ret = reg_submit(req, data, op, words, size);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+}
+
+/* Generate the "cache" control file content */
+static char *cache_dump(struct modbusfs_bus_s *bus, size_t *len)
+{
+	char *buf;
+	size_t size;
+	FILE *f;
+	struct modbusfs_client_s *cli;
+	unsigned long hits = 0, misses = 0;
+	unsigned long h, m;
+
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return NULL;
+
+	for_each_client(bus, cli) {
+		h = __atomic_load_n(&cli->cache_hits, __ATOMIC_RELAXED);
+		m = __atomic_load_n(&cli->cache_misses, __ATOMIC_RELAXED);
+		fprintf(f, "%d hits=%lu misses=%lu\n", cli->addr, h, m);
+
+		hits += h;
+		misses += m;
+	}
+	fprintf(f, "total hits=%lu misses=%lu\n", hits, misses);
+
+	fclose(f);
+	*len = size;
+
+	return buf;
+}
+
+/* Generate the "sched" control file content */
+static char *sched_dump(struct modbusfs_bus_s *bus, size_t *len)
+{
+	static const char *class_names[CLASSES_NUM] = {
+		[CLASS_CONTROL]		= "control",
+		[CLASS_INTERACTIVE]	= "interactive",
+		[CLASS_BULK]		= "bulk",
+	};
+	struct modbusfs_class_stats_s stats[CLASSES_NUM];
+	char *buf;
+	size_t size;
+	FILE *f;
+	int c;
+
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return NULL;
+
+	bus_sched_stats(bus, stats);
+	for (c = 0; c < CLASSES_NUM; c++)
+		fprintf(f, "%s depth=%lu reqs=%lu wait_avg=%lluus "
+			   "wait_max=%lluus\n",
+			class_names[c], stats[c].depth, stats[c].reqs,
+			(unsigned long long) (stats[c].reqs ?
+				stats[c].wait_sum / stats[c].reqs : 0),
+			(unsigned long long) stats[c].wait_max);
+
+	fclose(f);
+	*len = size;
+
+	return buf;
+}
+
+/*
+ * Generate the "stats" control file content of a bus, or of a client
+ * if "cli" is not NULL
+ */
+static char *stats_dump(struct modbusfs_bus_s *bus,
+			struct modbusfs_client_s *cli, size_t *len)
+{
+	struct modbusfs_stats_s st;
+	struct modbusfs_slave_s slave;
+	uint64_t elapsed = now_us() - bus->start;
+	unsigned long tx = 0;
+	char *buf;
+	size_t size;
+	FILE *f;
+	int i;
+
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return NULL;
+
+	bus_stats(bus, cli ? cli->addr : -1, &st);
+
+	for (i = 0; i < BUS_OPS_NUM; i++)
+		tx += st.tx[i];
+	fprintf(f, "transactions total=%lu", tx);
+	for (i = 0; i < BUS_OPS_NUM; i++)
+		fprintf(f, " fc%02d=%lu", bus_op_fc[i], st.tx[i]);
+	fprintf(f, "\n");
+
+	fprintf(f, "latency p50=%lluus p99=%lluus max=%lluus\n",
+		(unsigned long long) bus_stats_percentile(&st, 50),
+		(unsigned long long) bus_stats_percentile(&st, 99),
+		(unsigned long long) st.lat_max);
+	fprintf(f, "errors timeouts=%lu crc=%lu exceptions=%lu other=%lu "
+		   "retries=%lu\n",
+		st.timeouts, st.crc_errors, st.exceptions, st.errors,
+		st.retries);
+	fprintf(f, "bytes tx=%lu rx=%lu\n", st.bytes_tx, st.bytes_rx);
+	if (!cli)
+		fprintf(f, "mutex wait=%lluus contended=%lu\n",
+			(unsigned long long) STAT_GET(bus->mutex_wait),
+			STAT_GET(bus->mutex_contended));
+	else {
+		bus_slave_health(bus, cli->addr, &slave);
+		fprintf(f, "health %s timeout=%ums rtt=%lluus fails=%d\n",
+			slave.quarantined ? "quarantined" : "ok",
+			bus_slave_timeout(bus, &slave),
+			(unsigned long long) slave.srtt, slave.fails);
+	}
+
+	/* Connections can be busy at the same time */
+	fprintf(f, "utilization=%.1f%%\n", elapsed ?
+		100.0 * st.busy / elapsed / bus->conns_num : 0.0);
+
+	fclose(f);
+	*len = size;
+
+	return buf;
+}
+
+static modbus_t *client_connect(enum modbus_type_e modbus_type,
+				       struct modbus_parms_s modbus_parms)
+{
+	modbus_t *ctx;
+	char port[16];
+	int ret;
+
+	switch (modbus_type) {
+	case RTU:
+		dbg("RTU on %s at %d %d%c%d",
+				     modbus_parms.rtu.serial_dev,
+				     modbus_parms.rtu.baud,
+				     modbus_parms.rtu.bytes,
+				     modbus_parms.rtu.parity,
+				     modbus_parms.rtu.stop);
+		ctx = modbus_new_rtu(modbus_parms.rtu.serial_dev,
+				     modbus_parms.rtu.baud,
+				     modbus_parms.rtu.parity,
+				     modbus_parms.rtu.bytes,
+				     modbus_parms.rtu.stop);
+		break;
+
+	case TCP:
+		dbg("TCP on %s port %d", modbus_parms.tcp.host,
+					 modbus_parms.tcp.port);
+		sprintf(port, "%d", modbus_parms.tcp.port);
+		ctx = modbus_new_tcp_pi(modbus_parms.tcp.host, port);
+		break;
+
+	default:
+		BUG();
+	}
+	if (!ctx) {
+		err("MODBUS init error: %s", modbus_strerror(errno));
+		goto exit;
+	}
+
+	ret = modbus_connect(ctx);
+	if (ret == -1) {
+		err("MODBUS connect error: %s", modbus_strerror(errno));
+		goto free;
+	}
+
+	return ctx;
+
+free:
+	modbus_free(ctx);
+exit:
+	return NULL;
+}
+
+/*
+ * Keep the cached values of the exported registers in sync with the
+ * map files accesses, a NULL "val" drops them. Values wider than one
+ * register and not fully inside the range are dropped too.
+ */
+static void cache_update(struct modbusfs_client_s *cli, enum reg_type_e table,
+			 int idx, int nb, const uint16_t *val)
+{
+	struct modbusfs_register_s *reg;
+	int i;
+
+	for (i = 1 - dtype_nregs(DT_FLOAT64); i < nb; i++) {
+		reg = find_register(cli, table, idx + i);
+		if (!reg || !(reg->ttl || reg->poll))
+			continue;
+		if (i + reg->nregs <= 0)
+			continue;
+
+		if (val && i >= 0 && i + reg->nregs <= nb)
+			reg_cache_store(reg, reg_value(reg, &val[i]));
+		else
+			reg_cache_drop(reg);
+	}
+}
+
+/*
+ * Check an access to a map file and return the registers (or bits)
+ * range
+ */
+static int regs_range(enum reg_type_e table, off_t offset, size_t size,
+		      int *idx, int *nb)
 {
-	char delimiter[] = "/";
-	char *tok, *env;
+	if (reg_type_is_bit(table)) {
+		if (offset >= BITS_FILE_SIZE)
+			size = 0;
+		else
+			size = min(size, BITS_FILE_SIZE - (size_t) offset);
+		*idx = offset * 8;
+		*nb = size * 8;
+
+		return 0;
+	}
 
-	*elem = NULL;
-	*num = 0;
+	/* Registers cannot be split */
+	if ((offset | size) & 1)
+		return -EINVAL;
 
-	tok = strtok_r(path, delimiter, &env);
-	while (tok) {
-		*elem = realloc(*elem, sizeof(char *) * (*num + 1));
-		EXIT_ON(!*elem);
+	if (offset >= REGS_FILE_SIZE)
+		size = 0;
+	else
+		size = min(size, REGS_FILE_SIZE - (size_t) offset);
+	*idx = offset / 2;
+	*nb = size / 2;
+
+	return 0;
+}
+
+/*
+ * Read the registers range into "buf" as big-endian words, or the bits
+ * range as a bitmap
+ */
+static int regs_read(struct modbusfs_client_s *cli, enum reg_type_e table,
+		     char *buf, size_t size, off_t offset)
+{
+	uint16_t *val = (uint16_t *) buf;
+	int idx, nb;
+	int i;
+	int ret;
 
-		(*elem)[*num] = tok;
-		(*num)++;
+	ret = regs_range(table, offset, size, &idx, &nb);
+	if (ret < 0 || nb == 0)
+		return ret;
+	dbg("addr=%d table=%d idx=%d nb=%d", cli->addr, table, idx, nb);
 
-		tok = strtok_r(NULL, delimiter, &env);
+	/* Queued writes must reach the slave first */
+	if (table == REG_HOLDING && cli->linger) {
+		ret = wb_flush(cli);
+		if (ret < 0)
+			return ret;
 	}
 
-	return 0;
+	/* Bits are read one per word and then packed */
+	if (reg_type_is_bit(table)) {
+		val = malloc(sizeof(uint16_t) * nb);
+		if (!val)
+			return -ENOMEM;
+	}
+
+	ret = bus_read_table(cli->bus, table, cli->addr, idx, nb, val);
+	if (ret == -1) {
+		ret = -EIO;
+		goto exit;
+	}
+	cache_update(cli, table, idx, nb, val);
+
+	if (reg_type_is_bit(table)) {
+		memset(buf, 0, nb / 8);
+		for (i = 0; i < nb; i++)
+			buf[i / 8] |= val[i] << (i % 8);
+		ret = nb / 8;
+	} else {
+		for (i = 0; i < nb; i++)
+			val[i] = htobe16(val[i]);
+		ret = nb * 2;
+	}
+
+exit:
+	if (val != (uint16_t *) buf)
+		free(val);
+	return ret;
 }
 
-/* TODO: we should check group & other permissions too */
-static int have_permissions(int flags, int mode)
+static int regs_write(struct modbusfs_client_s *cli, enum reg_type_e table,
+		      const char *buf, size_t size, off_t offset)
 {
-	flags &= O_ACCMODE;
+	uint16_t *val;
+	int idx, nb;
+	int i;
+	int ret;
 
-	if (flags == O_RDONLY && !(mode & S_IRUSR))
-		return 0;
-	if (flags == O_WRONLY && !(mode & S_IWUSR))
+	ret = regs_range(table, offset, size, &idx, &nb);
+	if (ret < 0)
+		return ret;
+	if (nb != (reg_type_is_bit(table) ? size * 8 : size / 2))
+		return -EFBIG;
+	if (nb == 0)
 		return 0;
+	dbg("addr=%d table=%d idx=%d nb=%d", cli->addr, table, idx, nb);
 
-	return 1;	/* ok */
+	/* Queued writes must not overwrite the new values later */
+	if (table == REG_HOLDING && cli->linger) {
+		ret = wb_flush(cli);
+		if (ret < 0)
+			return ret;
+	}
+
+	val = malloc(sizeof(uint16_t) * nb);
+	if (!val)
+		return -ENOMEM;
+	if (reg_type_is_bit(table)) {
+		for (i = 0; i < nb; i++)
+			val[i] = ((uint8_t) buf[i / 8] >> (i % 8)) & 1;
+		ret = bus_write_coils(cli->bus, cli->addr, idx, nb, val);
+	} else {
+		for (i = 0; i < nb; i++)
+			val[i] = (uint8_t) buf[i * 2] << 8 |
+				 (uint8_t) buf[i * 2 + 1];
+		ret = bus_write_registers(cli->bus, cli->addr, idx, nb, val);
+	}
+	if (ret == -1) {
+		/* We don't know the registers' status anymore */
+		cache_update(cli, table, idx, nb, NULL);
+		free(val);
+		return -EIO;
+	}
+	cache_update(cli, table, idx, nb, val);
+	free(val);
+
+	return size;
+}
+
+/*
+ * Plan the reads of a client's snapshot: the readable registers of each
+ * table are covered by the fewest ranges, bridging the holes up to the
+ * coalescing gap as the bus does when merging reads. Return the number
+ * of ranges, each one with its first register into "first".
+ */
+static int snapshot_plan(struct modbusfs_client_s *cli,
+			 struct modbusfs_register_s ***regs, int *regs_num,
+			 struct modbusfs_req_s **reqs, int **first)
+{
+	struct modbusfs_register_s *reg;
+	struct modbusfs_req_s *req;
+	enum reg_type_e t;
+	int size = 0, reqs_size = 0;
+	int n = 0, r = 0;
+	int gap, max;
+	int hi;
+
+	*regs = NULL;
+	*reqs = NULL;
+	*first = NULL;
+
+	for (t = 0; t < REG_TYPES_NUM; t++) {
+		gap = bus_read_gap(bus_read_op[t]);
+		max = bus_read_max(bus_read_op[t]);
+		req = NULL;
+
+		for_each_register(cli, t, reg) {
+			if (!(reg->mode & (S_IRUSR | S_IRGRP | S_IROTH)))
+				continue;
+
+			if (r == size) {
+				size = size ? size * 2 : 64;
+				*regs = realloc(*regs, sizeof(**regs) * size);
+				EXIT_ON(!*regs);
+			}
+			(*regs)[r++] = reg;
+
+			hi = reg->idx + reg->nregs - 1;
+			if (req && reg->idx <= req->idx + req->nb + gap &&
+			    hi - req->idx + 1 <= max) {
+				req->nb = hi - req->idx + 1;
+				continue;
+			}
+
+			if (n == reqs_size) {
+				reqs_size = reqs_size ? reqs_size * 2 : 16;
+				*reqs = realloc(*reqs,
+						sizeof(**reqs) * reqs_size);
+				*first = realloc(*first,
+						 sizeof(**first) * reqs_size);
+				EXIT_ON(!*reqs || !*first);
+			}
+			req = &(*reqs)[n];
+			*req = (struct modbusfs_req_s) {
+				.op	= bus_read_op[t],
+				.addr	= cli->addr,
+				.idx	= reg->idx,
+				.nb	= reg->nregs,
+			};
+			(*first)[n++] = r - 1;
+		}
+	}
+
+	*regs_num = r;
+	return n;
+}
+
+/*
+ * Read a register alone after its range has been refused, return NULL
+ * on error
+ */
+static uint16_t *snapshot_retry(struct modbusfs_client_s *cli,
+				struct modbusfs_register_s *reg,
+				enum bus_op_e op, uint16_t *val)
+{
+	struct modbusfs_req_s req = {
+		.op	= op,
+		.addr	= cli->addr,
+		.idx	= reg->idx,
+		.nb	= reg->nregs,
+		.val	= val,
+	};
+
+	bus_submit(cli->bus, &req);
+	if (bus_wait(cli->bus, &req) == -1)
+		return NULL;
+	cache_update(cli, reg->type, reg->idx, reg->nregs, val);
+
+	return val;
+}
+
+/*
+ * Generate a client's "snapshot" control file content: all the planned
+ * reads are queued at once so that they run back to back, and the values
+ * are reported with the time they were requested at. A range refused by
+ * the slave (maybe some registers into the holes do not exist) is read
+ * again register by register, and values whose read failed are "-".
+ */
+static char *snapshot_dump(struct modbusfs_client_s *cli, size_t *len)
+{
+	struct modbusfs_bus_s *bus = cli->bus;
+	struct modbusfs_register_s **regs, *reg;
+	struct modbusfs_req_s *reqs;
+	struct timespec ts;
+	uint16_t *vals, *v;
+	uint64_t val;
+	int *first;
+	char *buf;
+	char str[32];
+	size_t size;
+	FILE *f;
+	int n, regs_num, total = 0;
+	int i, r, last;
+	int ret, err;
+
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return NULL;
+
+	n = snapshot_plan(cli, &regs, &regs_num, &reqs, &first);
+	for (i = 0; i < n; i++)
+		total += reqs[i].nb;
+	vals = malloc(sizeof(uint16_t) * (total + 1));
+	EXIT_ON(!vals);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	for (i = 0, v = vals; i < n; v += reqs[i].nb, i++) {
+		reqs[i].val = v;
+		bus_submit(bus, &reqs[i]);
+	}
+
+	fprintf(f, "time=%lld.%03ld\n", (long long) ts.tv_sec,
+		ts.tv_nsec / 1000000);
+	for (i = 0; i < n; i++) {
+		ret = bus_wait(bus, &reqs[i]);
+		err = errno;
+		last = i + 1 < n ? first[i + 1] : regs_num;
+		if (ret != -1)
+			cache_update(cli, regs[first[i]]->type, reqs[i].idx,
+				     reqs[i].nb, reqs[i].val);
+
+		for (r = first[i]; r < last; r++) {
+			reg = regs[r];
+			v = &reqs[i].val[reg->idx - reqs[i].idx];
+			if (ret == -1)
+				v = last - first[i] > 1 &&
+				    bus_answered(ret, err) ?
+					snapshot_retry(cli, reg,
+						       reqs[i].op, v) :
+					NULL;
+
+			if (reg->type != REG_HOLDING)
+				fprintf(f, "%s/", table_dirs[reg->type]);
+			if (!v) {
+				fprintf(f, "%d=-\n", reg->idx);
+				continue;
+			}
+
+			/* Raw formats are shown as hex text */
+			val = reg_value(reg, v);
+			if (reg->fmt == FMT_LE || reg->fmt == FMT_BE)
+				fprintf(f, "%d=%llx\n", reg->idx,
+					(unsigned long long) val);
+			else {
+				format_value(reg, val, str);
+				fprintf(f, "%d=%s\n", reg->idx, str);
+			}
+		}
+	}
+
+	fclose(f);
+	*len = size;
+
+	free(vals);
+	free(first);
+	free(reqs);
+	free(regs);
+	return buf;
+}
+
+/*
+ * Execute the "Read/Write Multiple Registers" (FC23) written into a
+ * client's "xfer" file as "<idx>=<val>[,<val>...] <first>[-<last>]":
+ * the hex values are written from register "idx" and then the range is
+ * read by the same transaction. The result is kept for the next reads
+ * of the same open file.
+ */
+static int xfer_write(struct modbusfs_data_s *data, const char *str)
+{
+	struct modbusfs_client_s *cli = data->cli;
+	uint16_t src[MODBUS_MAX_WR_WRITE_REGISTERS];
+	uint16_t dest[MODBUS_MAX_WR_READ_REGISTERS];
+	unsigned int val;
+	int idx, first, last, nb = 0;
+	char *buf;
+	size_t size;
+	FILE *f;
+	int n = 0, i;
+	int ret;
+
+	if (sscanf(str, "%d=%n", &idx, &n) != 1 || n == 0)
+		return -EINVAL;
+	str += n;
+	for (;;) {
+		if (nb == MODBUS_MAX_WR_WRITE_REGISTERS || !isxdigit(*str) ||
+		    sscanf(str, "%x%n", &val, &n) != 1 || val > 0xffff)
+			return -EINVAL;
+		src[nb++] = val;
+		str += n;
+		if (*str != ',')
+			break;
+		str++;
+	}
+
+	if (!isspace(*str) || sscanf(str, " %d%n", &first, &n) != 1)
+		return -EINVAL;
+	str += n;
+	last = first;
+	if (*str == '-') {
+		if (!isdigit(str[1]) || sscanf(str + 1, "%d%n", &last, &n) != 1)
+			return -EINVAL;
+		str += n + 1;
+	}
+	if (str[strspn(str, " \t\n")])
+		return -EINVAL;
+
+	if (idx < 0 || idx + nb - 1 > 0xffff || first < 0 || last > 0xffff ||
+	    last < first || last - first + 1 > MODBUS_MAX_WR_READ_REGISTERS ||
+	    is_broadcast(cli->addr))
+		return -EINVAL;
+	dbg("addr=%d write %d/%d read %d-%d", cli->addr, idx, nb, first, last);
+
+	/* Queued writes must not overwrite the new values later */
+	if (cli->linger) {
+		ret = wb_flush(cli);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = bus_write_and_read_registers(cli->bus, cli->addr, idx, nb, src,
+					   first, last - first + 1, dest);
+	if (ret == -1) {
+		/* We don't know if the registers have been written */
+		cache_update(cli, REG_HOLDING, idx, nb, NULL);
+		return -EIO;
+	}
+	cache_update(cli, REG_HOLDING, idx, nb, src);
+	cache_update(cli, REG_HOLDING, first, last - first + 1, dest);
+
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return -ENOMEM;
+	for (i = 0; i <= last - first; i++)
+		fprintf(f, "%d=%x\n", first + i, dest[i]);
+	fclose(f);
+
+	free(data->buf);
+	data->buf = buf;
+	data->len = size;
+
+	return 0;
+}
+
+/* Add a directory entry to the listing into the per file data */
+static int dir_add(fuse_req_t req, struct modbusfs_data_s *data,
+		   const char *name, fuse_ino_t ino, mode_t mode)
+{
+	struct stat stbuf = {
+		.st_ino		= ino,
+		.st_mode	= mode,
+	};
+	size_t size;
+	char *buf;
+
+	size = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+	if (data->len + size > data->alloc) {
+		data->alloc = max(data->alloc * 2, data->len + size + 4096);
+		buf = realloc(data->buf, data->alloc);
+		if (!buf)
+			return -ENOMEM;
+		data->buf = buf;
+	}
+	fuse_add_direntry(req, data->buf + data->len, size, name, &stbuf,
+			  data->len + size);
+	data->len += size;
+
+	return 0;
+}
+
+/* Reply with the part of "buf" the user asked for */
+static void reply_buf(fuse_req_t req, const char *buf, size_t len,
+		      off_t offset, size_t size)
+{
+	if (offset >= len) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+
+	fuse_reply_buf(req, buf + offset, min(size, len - (size_t) offset));
+}
+
+static struct modbusfs_data_s *alloc_data(const struct modbusfs_node_s *n)
+{
+	struct modbusfs_data_s *data;
+
+        data = calloc(1, sizeof(struct modbusfs_data_s));
+        if (!data)
+        	return NULL;
+	data->bus = n->bus;
+	data->cli = n->cli;
+	data->table = n->table;
+	data->reg = n->reg;
+	data->bit = n->bit;
+	data->ctrl_file = n->ctrl_file;
+
+	return data;
 }
 
-static int read_register(modbus_t * ctx, int addr, int idx, uint16_t * dest)
+static void free_data(struct modbusfs_data_s *data)
 {
+	if (data) {
+		if (data->reg)
+			monitor_release(data);
+		free(data->buf);
+		free(data);
+	}
+}
+
+/* Notify the kernel that an un-exported register file is gone */
+static void notify_deleted(struct modbusfs_client_s *cli,
+			   enum reg_type_e table, int idx)
+{
+	struct modbusfs_bus_s *bus = cli->bus;
+	fuse_ino_t parent, dir;
+	char name[16];
+	int bit;
 	int ret;
 
-	EXIT_ON(pthread_mutex_lock(&ctx_mutex));
+	if (!chan)
+		return;
+
+	if (table == REG_HOLDING)
+		parent = INO(INO_CLIENT, bus->id, cli->addr, 0);
+	else
+		parent = INO(INO_TABLE, bus->id, cli->addr, table);
+
+	sprintf(name, "%d", idx);
+	ret = fuse_lowlevel_notify_delete(chan, parent,
+					  INO(INO_REGISTER + table, bus->id,
+					      cli->addr, idx),
+					  name, strlen(name));
+	if (ret < 0 && ret != -ENOENT)
+		dbg("cannot invalidate entry %s: %s", name, strerror(-ret));
+
+	/* And its bits view, if any, starting from the bits files */
+	if (table != REG_HOLDING)
+		return;
+	dir = INO(INO_BITS, bus->id, cli->addr, idx);
+	for (bit = 0; bit < 16; bit++) {
+		sprintf(name, "%d", bit);
+		ret = fuse_lowlevel_notify_inval_entry(chan, dir,
+						       name, strlen(name));
+		if (ret < 0)
+			break;	/* the kernel doesn't know the directory */
+	}
+	sprintf(name, "%d.bits", idx);
+	ret = fuse_lowlevel_notify_delete(chan, parent,
+					  INO(INO_BITS, bus->id, cli->addr, idx),
+					  name, strlen(name));
+	if (ret < 0 && ret != -ENOENT)
+		dbg("cannot invalidate entry %s: %s", name, strerror(-ret));
+}
 
-	ret = modbus_set_slave(ctx, addr);
-	if (ret == -1)
-		goto unlock;
+/*
+ * Execute the entries written into a client's exports file. Entries are
+ * executed in order and each one as a whole: if any register of its
+ * range is already exported (or not exported, when un-exporting) the
+ * entry fails and the following ones are not executed.
+ */
+static int regs_exports(struct modbusfs_client_s *cli, enum reg_type_e table,
+			char *str)
+{
+	struct modbusfs_bus_s *bus = cli->bus;
+	struct modbusfs_export_s *entries, *e;
+	struct modbusfs_register_s *reg;
+	int n, i, idx, j, nregs;
+	int poll = 0;
+	int ret = 0;
+
+	n = parse_exports(str, &entries, parse_reg_entry);
+	if (n < 0)
+		return -EINVAL;
+
+	/* Check user input */
+	for (i = 0; i < n; i++) {
+		e = &entries[i];
+		dbg("addr=%d table=%d %s %d-%d/%d mode=%o", cli->addr, table,
+		    e->del ? "del" : "add", e->first, e->last, e->step,
+		    e->mode);
+
+		if (e->last > 0xffff)
+			goto einval;
+		if (e->del)
+			continue;
+
+		if ((e->mode & MODE_REG_MASK) != e->mode)
+			goto einval;
+		if (reg_type_is_ro(table) &&
+		    (e->mode & (S_IWUSR | S_IWGRP | S_IWOTH)))
+			goto einval;
+
+		/* Typed values span consecutive registers which cannot overlap */
+		if (e->reg_opts.dtype != DT_UINT16 && reg_type_is_bit(table))
+			goto einval;
+		if (e->reg_opts.bits &&
+		    (table != REG_HOLDING || is_broadcast(cli->addr) ||
+		     dtype_nregs(e->reg_opts.dtype) > 1))
+			goto einval;
+		nregs = dtype_nregs(e->reg_opts.dtype);
+		if (nregs > 1 &&
+		    (e->reg_opts.deadband || e->last + nregs - 1 > 0xffff ||
+		     (e->first != e->last && e->step < nregs)))
+			goto einval;
+
+		/* Broadcast registers can be written only */
+		if (is_broadcast(cli->addr) &&
+		    (reg_type_is_ro(table) || e->reg_opts.poll ||
+		     (e->mode & (S_IRUSR | S_IRGRP | S_IROTH))))
+			goto einval;
+		poll |= e->reg_opts.poll;
+	}
 
-	ret = modbus_read_registers(ctx, idx, 1, dest);
+	EXIT_ON(pthread_mutex_lock(&bus->lock));
+	for (i = 0; i < n && ret == 0; i++) {
+		e = &entries[i];
+
+		nregs = dtype_nregs(e->reg_opts.dtype);
+		for (idx = e->first; idx <= e->last && ret == 0;
+		     idx += e->step) {
+			if (e->del) {
+				if (!find_register(cli, table, idx))
+					ret = -ENOENT;
+				continue;
+			}
 
-unlock:
-	EXIT_ON(pthread_mutex_unlock(&ctx_mutex));
+			/* No exported value may span our registers */
+			for (j = max(idx - 3, 0); j < idx + nregs; j++) {
+				reg = find_register(cli, table, j);
+				if (reg && j + reg->nregs > idx) {
+					ret = -EEXIST;
+					break;
+				}
+			}
+		}
+		if (ret < 0)
+			break;
 
+		for (idx = e->first; idx <= e->last && ret == 0; idx += e->step)
+			if (e->del)
+				ret = del_reg(cli, table, idx);
+			else
+				ret = add_reg(cli, table, idx, e->mode,
+					      &e->reg_opts);
+	}
+	EXIT_ON(pthread_mutex_unlock(&bus->lock));
+
+	/* Entries after the failing one have not been executed */
+	n = i;
+
+	for (i = 0; i < n; i++) {
+		e = &entries[i];
+		if (!e->del)
+			continue;
+		for (idx = e->first; idx <= e->last; idx += e->step)
+			if (!find_register(cli, table, idx))
+				notify_deleted(cli, table, idx);
+	}
+	if (table == REG_HOLDING)
+		notify_dir_changed(INO(INO_CLIENT, bus->id, cli->addr, 0));
+	else
+		notify_dir_changed(INO(INO_TABLE, bus->id, cli->addr, table));
+	if (poll)
+		poller_kick(bus);
+
+	free(entries);
 	return ret;
+
+einval:
+	free(entries);
+	return -EINVAL;
 }
 
-static int write_register(modbus_t * ctx, int addr, int idx, int value)
+/* Execute the entries written into a bus's exports file */
+static int clients_exports(struct modbusfs_bus_s *bus, char *str)
 {
-	int ret;
+	struct modbusfs_export_s *entries, *e;
+	int n, i, addr;
+	int ret = 0;
+
+	n = parse_exports(str, &entries, parse_cli_entry);
+	if (n < 0)
+		return -EINVAL;
+
+	/* Check user input */
+	for (i = 0; i < n; i++) {
+		e = &entries[i];
+		dbg("%d-%d/%d mode=%o linger=%u", e->first, e->last, e->step,
+		    e->mode, e->cli_opts.linger);
+
+		if (e->del)			/* clients cannot be removed */
+			goto einval;
+		if (e->first < 0 || e->last > 254)
+			goto einval;
+		if ((e->mode & MODE_CLI_MASK) != e->mode)
+			goto einval;
+	}
 
-	EXIT_ON(pthread_mutex_lock(&ctx_mutex));
+	EXIT_ON(pthread_mutex_lock(&bus->lock));
+	for (i = 0; i < n && ret == 0; i++) {
+		e = &entries[i];
 
-	ret = modbus_set_slave(ctx, addr);
-	if (ret == -1)
-		goto unlock;
+		for (addr = e->first; addr <= e->last; addr += e->step)
+			if (find_client(bus, addr)) {
+				ret = -EEXIST;
+				break;
+			}
 
-	ret = modbus_write_register(ctx, idx, value);
+		for (addr = e->first; addr <= e->last && ret == 0;
+		     addr += e->step)
+			ret = add_client(bus, addr, e->mode, &e->cli_opts);
+	}
+	EXIT_ON(pthread_mutex_unlock(&bus->lock));
 
-unlock:
-	EXIT_ON(pthread_mutex_unlock(&ctx_mutex));
+	notify_dir_changed(bus_ino(bus));
 
+	free(entries);
 	return ret;
+
+einval:
+	free(entries);
+	return -EINVAL;
+}
+
+/*
+ * Generate the "scan" control file content of a bus, or of all buses
+ * if "bus" is NULL
+ */
+static char *scan_dump(struct modbusfs_bus_s *bus, size_t *len)
+{
+	char *buf;
+	size_t size;
+	FILE *f;
+	int b;
+
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return NULL;
+
+	for (b = 0; b < buses_num; b++) {
+		if (bus && bus != &buses[b])
+			continue;
+		if (!bus)
+			fprintf(f, "bus %d\n", b);
+
+		EXIT_ON(pthread_mutex_lock(&buses[b].lock));
+		if (buses[b].scan_buf)
+			fwrite(buses[b].scan_buf, 1, buses[b].scan_len, f);
+		EXIT_ON(pthread_mutex_unlock(&buses[b].lock));
+	}
+
+	fclose(f);
+	*len = size;
+
+	return buf;
 }
 
-static int add_client(uint8_t addr, unsigned int mode)
+/*
+ * Execute the entries written into a "scan" file on a bus or, if "bus"
+ * is NULL, on all buses at once. The answering slaves are exported as
+ * clients (unless they already are) and replace the bus's last
+ * results.
+ */
+static int scan_write(struct modbusfs_bus_s *bus, char *str)
 {
-	struct modbusfs_client_s *ptr;
+	struct modbusfs_export_s *entries, *e;
+	struct modbusfs_scan_s **scans;
+	int first = bus ? bus->id : 0;
+	int last = bus ? bus->id : buses_num - 1;
+	char *buf[BUSES_MAX];
+	size_t size[BUSES_MAX];
+	FILE *f[BUSES_MAX];
+	int n, i, b, k, err;
+	int ret = 0;
+
+	n = parse_exports(str, &entries, parse_scan_entry);
+	if (n < 0)
+		return -EINVAL;
+
+	/* Check user input */
+	for (i = 0; i < n; i++) {
+		e = &entries[i];
+		dbg("%d-%d/%d mode=%o timeout=%u", e->first, e->last, e->step,
+		    e->mode, e->timeout);
+
+		if (e->del || e->first < 1 || e->last > 254)
+			goto einval;
+		if ((e->mode & MODE_CLI_MASK) != e->mode)
+			goto einval;
+	}
 
-	ptr = realloc(clients,
-		      sizeof(struct modbusfs_client_s) * (clients_num + 1));
-	if (!ptr)
+	scans = calloc(n * (last - first + 1), sizeof(*scans));
+	if (!scans) {
+		free(entries);
 		return -ENOMEM;
-	ptr[clients_num].addr = addr;
-	ptr[clients_num].mode = mode;
-	ptr[clients_num].regs = NULL;
-	ptr[clients_num].regs_num = 0;
+	}
+	for (b = first; b <= last; b++) {
+		f[b] = open_memstream(&buf[b], &size[b]);
+		if (!f[b]) {
+			while (--b >= first) {
+				fclose(f[b]);
+				free(buf[b]);
+			}
+			free(scans);
+			free(entries);
+			return -ENOMEM;
+		}
+	}
+
+	/* Start all the scans before waiting for any of them */
+	for (b = first, k = 0; b <= last; b++)
+		for (i = 0; i < n; i++, k++) {
+			e = &entries[i];
+			scans[k] = scan_start(&buses[b], e->first, e->last,
+					      e->step, e->timeout);
+			if (!scans[k])
+				ret = -ENOMEM;
+		}
+
+	for (b = first, k = 0; b <= last; b++) {
+		for (i = 0; i < n; i++, k++) {
+			if (!scans[k])
+				continue;
+			err = scan_finish(scans[k], entries[i].mode, f[b]);
+			if (err < 0 && ret == 0)
+				ret = err;
+		}
 
-	clients = ptr;
+		fclose(f[b]);
+		EXIT_ON(pthread_mutex_lock(&buses[b].lock));
+		free(buses[b].scan_buf);
+		buses[b].scan_buf = buf[b];
+		buses[b].scan_len = size[b];
+		EXIT_ON(pthread_mutex_unlock(&buses[b].lock));
 
-	return ++clients_num;
+		notify_dir_changed(bus_ino(&buses[b]));
+	}
+
+	free(scans);
+	free(entries);
+	return ret;
+
+einval:
+	free(entries);
+	return -EINVAL;
 }
 
-static struct modbusfs_client_s *find_client(uint8_t addr) {
-	int c;
+/* Return true if two registers have the same exports settings */
+static int same_exports(const struct modbusfs_register_s *a,
+			const struct modbusfs_register_s *b)
+{
+	return a->mode == b->mode && a->ttl == b->ttl && a->poll == b->poll &&
+	       a->fmt == b->fmt && a->deadband == b->deadband &&
+	       a->dtype == b->dtype && a->words_le == b->words_le &&
+	       a->bytes_le == b->bytes_le && a->bits == b->bits;
+}
 
-        for (c = 0; c < clients_num; c++)
-		if (clients[c].addr == addr)
-			break;
-	if (c == clients_num)
+/*
+ * Write a client's registers of a type as map entries, merging the
+ * registers with the same settings and evenly spaced into ranges
+ */
+static void map_dump_regs(FILE *f, struct modbusfs_client_s *cli,
+			  enum reg_type_e t)
+{
+	struct modbusfs_register_s *first, *last, *reg;
+	int step, num;
+
+	first = next_register(cli, t, NULL);
+	while (first) {
+		last = first;
+		step = 0;
+		num = 1;
+		for (reg = next_register(cli, t, first); reg;
+		     reg = next_register(cli, t, reg)) {
+			if (!same_exports(reg, first))
+				break;
+			if (step && reg->idx - last->idx != step)
+				break;
+			step = reg->idx - last->idx;
+			last = reg;
+			num++;
+		}
+
+		/* Two far registers are not worth a stride */
+		if (num == 2 && step > 1) {
+			last = first;
+			reg = next_register(cli, t, first);
+		}
+
+		fprintf(f, "%s %d", map_tables[t], first->idx);
+		if (last != first)
+			fprintf(f, "-%d", last->idx);
+		if (last != first && step > 1)
+			fprintf(f, "/%d", step);
+		fprintf(f, " %04o", first->mode);
+		if (first->ttl)
+			fprintf(f, " %ums", first->ttl);
+		if (first->poll)
+			fprintf(f, " poll=%ums", first->poll);
+		if (first->dtype != DT_UINT16)
+			fprintf(f, " type=%s", dtype_names[first->dtype]);
+		if (first->words_le)
+			fprintf(f, " words=le");
+		if (first->bytes_le)
+			fprintf(f, " bytes=le");
+		if (first->fmt != default_fmt(first->dtype))
+			fprintf(f, " fmt=%s", fmt_names[first->fmt]);
+		if (first->deadband)
+			fprintf(f, " deadband=%u", first->deadband);
+		if (first->bits)
+			fprintf(f, " bits");
+		fprintf(f, "\n");
+
+		first = reg;
+	}
+}
+
+/* Generate the "map" control file content, see map_load() */
+static char *map_dump(struct modbusfs_bus_s *bus, size_t *len)
+{
+	struct modbusfs_client_s *cli;
+	enum reg_type_e t;
+	char *buf;
+	size_t size;
+	FILE *f;
+
+	f = open_memstream(&buf, &size);
+	if (!f)
 		return NULL;
 
-	return &clients[c];
+	EXIT_ON(pthread_mutex_lock(&bus->lock));
+	fprintf(f, "bus %d\n", bus->id);
+	for_each_client(bus, cli) {
+		fprintf(f, "client %d %04o", cli->addr, cli->mode);
+		if (cli->linger)
+			fprintf(f, " linger=%ums", cli->linger);
+		fprintf(f, "\n");
+
+		for (t = 0; t < REG_TYPES_NUM; t++)
+			map_dump_regs(f, cli, t);
+	}
+	EXIT_ON(pthread_mutex_unlock(&bus->lock));
+
+	fclose(f);
+	*len = size;
+
+	return buf;
 }
 
-static int add_reg(struct modbusfs_client_s *cli, int idx, unsigned int mode)
+/*
+ * Load the map file before mounting. Each line is "bus <n>", which
+ * selects the bus (the first one by default), "client <addr> <mode>
+ * [<options>]", which exports a client and selects it, or "<type>
+ * <range> <mode> [<options>]", which exports the selected client's
+ * registers of a type as the exports files do.
+ */
+static int map_load(const char *file)
 {
-	struct modbusfs_register_s *ptr;
+	struct modbusfs_bus_s *bus = &buses[0];
+	struct modbusfs_client_s *cli = NULL;
+	char *line = NULL, *ptr;
+	char key[16];
+	size_t size = 0;
+	int lineno = 0;
+	int t, n, val;
+	int ret = 0;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f) {
+		err("cannot open map file %s: %m", file);
+		return -1;
+	}
+
+	while (ret == 0 && getline(&line, &size, f) != -1) {
+		lineno++;
+		ptr = line + strspn(line, " \t\n");
+		if (*ptr == '\0' || *ptr == '#')
+			continue;
+
+		if (sscanf(ptr, "%15s %n", key, &n) != 1) {
+			ret = -EINVAL;
+			break;
+		}
+		ptr += n;
+
+		if (strcmp(key, "bus") == 0) {
+			if (sscanf(ptr, "%d", &val) != 1 ||
+			    val < 0 || val >= buses_num) {
+				ret = -EINVAL;
+				break;
+			}
+			bus = &buses[val];
+			cli = NULL;
+
+			continue;
+		}
+
+		if (strcmp(key, "client") == 0) {
+			if (sscanf(ptr, "%d", &val) != 1) {
+				ret = -EINVAL;
+				break;
+			}
+			ret = clients_exports(bus, ptr);
+			cli = find_client(bus, val);
+
+			continue;
+		}
+
+		for (t = 0; t < REG_TYPES_NUM; t++)
+			if (strcmp(key, map_tables[t]) == 0)
+				break;
+		if (t == REG_TYPES_NUM || !cli) {
+			ret = -EINVAL;
+			break;
+		}
+		ret = regs_exports(cli, t, ptr);
+	}
 
-	ptr = realloc(cli->regs,
-		      sizeof(struct modbusfs_register_s) * (cli->regs_num + 1));
-	if (!ptr)
-		return -ENOMEM;
-	ptr[cli->regs_num].idx = idx;
-	ptr[cli->regs_num].mode = mode;
-	ptr[cli->regs_num].cli = cli;
+	if (ret < 0)
+		err("%s:%d: %s", file, lineno, strerror(-ret));
+	else
+		dbg("loaded map file %s (%d lines)", file, lineno);
 
-	cli->regs = ptr;
+	free(line);
+	fclose(f);
 
-	return cli->regs_num++;
+	return ret;
 }
 
-static struct modbusfs_register_s *find_register(struct modbusfs_client_s *cli,
-					int idx)
+static int file_write(struct modbusfs_data_s *data, const char *buf,
+		      size_t size, off_t offset)
 {
-	int r;
+	struct modbusfs_bus_s *bus = data->bus;
+	char *str;
+	int ret;
 
-	for (r = 0; r < cli->regs_num; r++)
-		if (cli->regs[r].idx == idx)
-			break;
-	if (r == cli->regs_num)
-		return NULL;
+	/* Binary data go straight to the bus */
+	if (data->ctrl_file == CTRL_REGS)
+		return regs_write(data->cli, data->table, buf, size, offset);
 
-	return &cli->regs[r];
-}
+	/* User data are not NUL terminated */
+	str = strndupa(buf, size);
 
-static modbus_t *client_connect(enum modbus_type_e modbus_type,
-				       struct modbus_parms_s modbus_parms)
-{
-	modbus_t *ctx;
-	int ret;
+	if (data->cli && !data->reg) { 	/* Is it a client ctrl file? */
+		if (data->ctrl_file == CTRL_EXPORTS) {
+			ret = regs_exports(data->cli, data->table, str);
+			if (ret < 0)
+				return ret;
 
-	switch (modbus_type) {
-	case RTU:
-		dbg("RTU on %s at %d %d%c%d",
-				     modbus_parms.rtu.serial_dev,
-				     modbus_parms.rtu.baud,
-				     modbus_parms.rtu.bytes,
-				     modbus_parms.rtu.parity,
-				     modbus_parms.rtu.stop);
-		ctx = modbus_new_rtu(modbus_parms.rtu.serial_dev,
-				     modbus_parms.rtu.baud,
-				     modbus_parms.rtu.parity,
-				     modbus_parms.rtu.bytes,
-				     modbus_parms.rtu.stop);
-		break;
+			return size;
+		} else if (data->ctrl_file == CTRL_XFER) {
+			ret = xfer_write(data, str);
+			if (ret < 0)
+				return ret;
 
-	default:
-		BUG();
-	}
-	if (!ctx) {
-		err("MODBUS init error: %s", modbus_strerror(errno));
-		goto exit;
-	}
+			return size;
+		} else
+                	BUG();
+	} else if (!data->cli) {		/* Is it a global ctrl file? */
+		if (data->ctrl_file == CTRL_EXPORTS) {
+			ret = clients_exports(bus, str);
+			if (ret < 0)
+				return ret;
 
-	ret = modbus_connect(ctx);
-	if (ret == -1) {
-		err("MODBUS connect error: %s", modbus_strerror(errno));
-		goto free;
-	}
+			return size;
+		} else if (data->ctrl_file == CTRL_SCAN) {
+			ret = scan_write(bus, str);
+			if (ret < 0)
+				return ret;
 
-	return ctx;
+			return size;
+                } else
+                        BUG();
+	}
 
-free:
-	modbus_free(ctx);
-exit:
-	return NULL;
+	BUG();
 }
 
 /*
  * FUSER methods
  */
 
-static int modbusfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			    off_t offset, struct fuse_file_info *fi)
+static void modbusfs_init(void *userdata, struct fuse_conn_info *conn)
 {
-	char **elem;
-	size_t num;
-	int i, c, addr, idx;
-	char name[64];
-	int ret;
-	int res = 0;
-
-	dbg("path=%s", path);
-	parse_path(strdupa(path), &elem, &num);
-
-	switch (num) {
-	case 0 :	/* / */
-		filler(buf, ".", NULL, 0);
-		filler(buf, "..", NULL, 0);
-
-		/* The control files */
-		filler(buf, "exports", NULL, 0);
-
-		/* List all clients registers */
-		for (c = 0; c < clients_num; c++) {
-			addr = clients[c].addr;
-
-			sprintf(name, "%d", addr);
-			filler(buf, name, NULL, 0);
-		}
-
-		break;
-
-	case 1 :	/* /<addr> */
-		ret = sscanf(elem[0], "%d", &addr);
-		if (ret != 1) {
-			res = -ENOENT;
-			goto exit;
-		}
+	/* Let the kernel send "regs" writes larger than one page */
+	if (conn->capable & FUSE_CAP_BIG_WRITES)
+		conn->want |= FUSE_CAP_BIG_WRITES;
+}
 
-		for (c = 0; c < clients_num; c++)
-			if (clients[c].addr == addr)
-				break;
-		if (c == clients_num) {
-			res = -ENOENT;
-			goto exit;
-		}
-		dbg("addr=%d", addr);
+static void modbusfs_lookup(fuse_req_t req, fuse_ino_t parent,
+			    const char *name)
+{
+	struct modbusfs_node_s n;
+	struct fuse_entry_param e;
+	int ret;
 
-		/* The control files */
-		filler(buf, "exports", NULL, 0);
+	dbg("parent=%lx name=%s", parent, name);
+	ret = ino_node(parent, &n);
+	if (ret == 0)
+		ret = lookup_node(&n, name);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
 
-		/* List all clients */
-		for (i = 0; i < clients[c].regs_num; i++) {
-			idx = clients[c].regs[i].idx;
+	memset(&e, 0, sizeof(e));
+	e.ino = node_ino(&n);
+	e.attr_timeout = ATTR_TIMEOUT;
+	e.entry_timeout = ENTRY_TIMEOUT;
+	node_stat(&n, &e.attr);
 
-			sprintf(name, "%d", idx);
-			filler(buf, name, NULL, 0);
-		}
+	fuse_reply_entry(req, &e);
+}
 
-		break;
+static void modbusfs_getattr(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_file_info *fi)
+{
+	struct modbusfs_node_s n;
+	struct stat stbuf;
+	int ret;
 
-	default :
-		res = -ENOENT;
+	dbg("ino=%lx", ino);
+	ret = ino_node(ino, &n);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
 	}
 
-exit:
-	free(elem);
-	return res;
+	node_stat(&n, &stbuf);
+	fuse_reply_attr(req, &stbuf, ATTR_TIMEOUT);
+}
+
+static void modbusfs_setattr(fuse_req_t req, fuse_ino_t ino,
+			     struct stat *attr, int to_set,
+			     struct fuse_file_info *fi)
+{
+	/*
+	 * MODBUS files cannot be truncated!!! However we must accept
+	 * truncation in order to allow opening files with O_TRUNC, so
+	 * just return the current attributes.
+	 */
+	modbusfs_getattr(req, ino, fi);
 }
 
-static int modbusfs_getattr(const char *path, struct stat *stbuf)
+static void modbusfs_opendir(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_file_info *fi)
 {
-	char **elem;
-	size_t num;
-	int addr, idx;
+	struct modbusfs_node_s n;
+	struct modbusfs_data_s *data;
 	struct modbusfs_client_s *cli;
 	struct modbusfs_register_s *reg;
+	fuse_ino_t parent;
+	int i;
+	char name[64];
 	int ret;
-	int res = 0;
 
-	dbg("path=%s", path);
-	parse_path(strdupa(path), &elem, &num);
+	dbg("ino=%lx", ino);
+	ret = ino_node(ino, &n);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	if (n.type != NODE_ROOT && n.type != NODE_CLIENT &&
+	    n.type != NODE_TABLE && n.type != NODE_BITS) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
 
-	memset(stbuf, 0, sizeof(struct stat));
-	stbuf->st_uid = getuid();
-	stbuf->st_gid = getgid();
+	/* Allocate per file data */
+	data = alloc_data(&n);
+	if (!data) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
 
-	switch (num) {
-	case 0 :	/* / */
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
+	/* Build the whole listing now, readdir() serves it by chunks */
+	switch (n.type) {
+	case NODE_ROOT :	/* / */
+		parent = FUSE_ROOT_ID;
+		ret = dir_add(req, data, ".", ino, S_IFDIR);
+		ret |= dir_add(req, data, "..", parent, S_IFDIR);
+
+		/* List all buses */
+		if (!n.bus) {
+			ret |= dir_add(req, data, "scan",
+				       INO(INO_ROOT, 0, 0, CTRL_SCAN), S_IFREG);
+			for (i = 0; i < buses_num; i++) {
+				sprintf(name, "bus%d", i);
+				ret |= dir_add(req, data, name,
+					       bus_ino(&buses[i]), S_IFDIR);
+			}
 
-		break;
+			break;
+		}
 
-	case 1 :	/* /<addr|ctrl> */
-		ret = sscanf(elem[0], "%d", &addr);
-		if (ret == 1) {	/* it's a client address! */
-			dbg("addr=%d", addr);
-			cli = find_client(addr);
-			if (!cli) {
-				res = -ENOENT;
-				goto exit;
-			}
+		/* The control files */
+		ret |= dir_add(req, data, "exports",
+			       INO(INO_BUS_CTRL, n.bus->id, 0, CTRL_EXPORTS),
+			       S_IFREG);
+		ret |= dir_add(req, data, "cache",
+			       INO(INO_BUS_CTRL, n.bus->id, 0, CTRL_CACHE),
+			       S_IFREG);
+		ret |= dir_add(req, data, "sched",
+			       INO(INO_BUS_CTRL, n.bus->id, 0, CTRL_SCHED),
+			       S_IFREG);
+		ret |= dir_add(req, data, "stats",
+			       INO(INO_BUS_CTRL, n.bus->id, 0, CTRL_STATS),
+			       S_IFREG);
+		ret |= dir_add(req, data, "map",
+			       INO(INO_BUS_CTRL, n.bus->id, 0, CTRL_MAP),
+			       S_IFREG);
+		ret |= dir_add(req, data, "scan",
+			       INO(INO_BUS_CTRL, n.bus->id, 0, CTRL_SCAN),
+			       S_IFREG);
 
-			stbuf->st_mode = S_IFDIR | cli->mode;
-			stbuf->st_nlink = 2;
-		} else if (strcmp(elem[0], "exports") == 0) {
-			stbuf->st_mode = S_IFREG | S_IWUSR;
-			stbuf->st_nlink = 1;
-			stbuf->st_size = 0;	/* write only! */
-		} else
-			res = -ENOENT;
+		/* List all clients */
+		for_each_client(n.bus, cli) {
+			sprintf(name, "%d", cli->addr);
+			ret |= dir_add(req, data, name,
+				       INO(INO_CLIENT, n.bus->id, cli->addr, 0),
+				       S_IFDIR);
+		}
 
 		break;
 
-	case 2 :	/* /<addr>/<reg|ctrl> */
-		ret = sscanf(elem[0], "%d", &addr);
-		if (ret != 1) {
-			res = -ENOENT;
-			goto exit;
+	case NODE_CLIENT :	/* /<addr> */
+	case NODE_TABLE :	/* /<addr>/<table> */
+		dbg("addr=%d table=%d", n.cli->addr, n.table);
+		if (n.type == NODE_CLIENT)
+			parent = bus_ino(n.bus);
+		else
+			parent = INO(INO_CLIENT, n.bus->id, n.cli->addr, 0);
+		ret = dir_add(req, data, ".", ino, S_IFDIR);
+		ret |= dir_add(req, data, "..", parent, S_IFDIR);
+
+		/* The control files */
+		ret |= dir_add(req, data, "exports",
+			       INO(INO_CLIENT_CTRL, n.bus->id, n.cli->addr,
+				   n.table << 8 | CTRL_EXPORTS), S_IFREG);
+		ret |= dir_add(req, data, map_names[n.table],
+			       INO(INO_CLIENT_CTRL, n.bus->id, n.cli->addr,
+				   n.table << 8 | CTRL_REGS), S_IFREG);
+
+		/* The statistics and the other registers types */
+		if (n.type == NODE_CLIENT) {
+			ret |= dir_add(req, data, "stats",
+				       INO(INO_CLIENT_CTRL, n.bus->id,
+					   n.cli->addr, CTRL_STATS), S_IFREG);
+			ret |= dir_add(req, data, "snapshot",
+				       INO(INO_CLIENT_CTRL, n.bus->id,
+					   n.cli->addr, CTRL_SNAPSHOT),
+				       S_IFREG);
+			ret |= dir_add(req, data, "xfer",
+				       INO(INO_CLIENT_CTRL, n.bus->id,
+					   n.cli->addr, CTRL_XFER), S_IFREG);
+			for (i = REG_INPUT; i < REG_TYPES_NUM; i++)
+				ret |= dir_add(req, data, table_dirs[i],
+					       INO(INO_TABLE, n.bus->id,
+						   n.cli->addr, i), S_IFDIR);
 		}
-		dbg("addr=%d", addr);
 
-		ret = sscanf(elem[1], "%d", &idx);
-		if (ret == 1) {	/* it's a register! */
-			dbg("addr=%d idx=%d", addr, idx);
+		/* List all client's registers and their bits views */
+		for_each_register(n.cli, n.table, reg) {
+			sprintf(name, "%d", reg->idx);
+			ret |= dir_add(req, data, name,
+				       INO(INO_REGISTER + n.table, n.bus->id,
+					   n.cli->addr, reg->idx), S_IFREG);
+			if (!reg->bits)
+				continue;
+			sprintf(name, "%d.bits", reg->idx);
+			ret |= dir_add(req, data, name,
+				       INO(INO_BITS, n.bus->id, n.cli->addr,
+					   reg->idx), S_IFDIR);
+		}
 
-			cli = find_client(addr);
-			if (!cli) {
-				res = -ENOENT;
-				goto exit;
-			}
+		break;
 
-			reg = find_register(cli, idx);
-			if (!reg) {
-				res = -ENOENT;
-				goto exit;
-			}
+	case NODE_BITS :	/* /<addr>/<reg>.bits */
+		parent = INO(INO_CLIENT, n.bus->id, n.cli->addr, 0);
+		ret = dir_add(req, data, ".", ino, S_IFDIR);
+		ret |= dir_add(req, data, "..", parent, S_IFDIR);
 
-			stbuf->st_mode = S_IFREG | reg->mode;
-			stbuf->st_nlink = 1;
-			stbuf->st_size = 4;	/* all register are uint16_t! (0xHHHH) */
-		} else if (strcmp(elem[1], "exports") == 0) {
-			stbuf->st_mode = S_IFREG | S_IWUSR;
-			stbuf->st_nlink = 1;
-			stbuf->st_size = 0;	/* write only! */
-		} else
-			res = -ENOENT;
+		for (i = 0; i < 16; i++) {
+			sprintf(name, "%d", i);
+			ret |= dir_add(req, data, name,
+				       INO(INO_BIT, n.bus->id, i,
+					   n.reg->bits_handle - 1), S_IFREG);
+		}
 
 		break;
 
-        default :
-                res = -ENOENT;
+	default :
+		BUG();
+	}
+	if (ret < 0) {
+		free_data(data);
+		fuse_reply_err(req, ENOMEM);
+		return;
 	}
 
-exit:
-	free(elem);
-	return res;
+	fi->fh = (unsigned long) data;
+	fuse_reply_open(req, fi);
 }
 
-static int modbusfs_truncate(const char *path, off_t size)
+static void modbusfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			     off_t offset, struct fuse_file_info *fi)
 {
-	/* MODBUS files cannot be truncated!!! */
-	return 0;
+	struct modbusfs_data_s *data = (struct modbusfs_data_s *) fi->fh;
+
+	reply_buf(req, data->buf, data->len, offset, size);
 }
 
-static int modbusfs_read(const char *path, char *buf,
-			 size_t size, off_t offset, struct fuse_file_info *fi)
+static void modbusfs_releasedir(fuse_req_t req, fuse_ino_t ino,
+				struct fuse_file_info *fi)
 {
-	struct modbusfs_data_s *data = (struct modbusfs_data_s *)fi->fh;
-	int addr, idx;
-	int ret;
-	uint16_t val;
+	free_data((struct modbusfs_data_s *) fi->fh);
+	fuse_reply_err(req, 0);
+}
 
-	if (size < 4)
-		return -EIO;
+static void modbusfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	struct modbusfs_data_s *data = (struct modbusfs_data_s *) fi->fh;
+	int addr;
+	int ret;
+	char *rbuf;
 
-	dbg("path=%s", path);
+	dbg("ino=%lx", ino);
 
         if (data->cli && data->reg) {           /* Is it a client register? */
-                addr = data->cli->addr;
-                idx = data->reg->idx;
-		dbg("addr=%d idx=%d", addr, idx);
-
-		/* Read register content only at first read! */
-		if (offset == 0) {
-			ret = read_register(ctx, addr, idx, &val);
-			if (ret == -1)
-				return -EIO;
-
-			return sprintf(buf, "%x", val);
-		} else
-			return 0;
+		reg_read(req, data, size, offset);
+		return;
 	} else if (data->cli && !data->reg) {   /* Is it a client ctrl file? */
                 if (data->ctrl_file == CTRL_EXPORTS) {
                         addr = data->cli->addr;
 			dbg("addr=%d exports", addr);
 
-			return -EACCES;
+			fuse_reply_err(req, EACCES);
+			return;
+		} else if (data->ctrl_file == CTRL_STATS ||
+			   data->ctrl_file == CTRL_SNAPSHOT) {
+			dbg("addr=%d stats/snapshot", data->cli->addr);
+
+			reply_buf(req, data->buf, data->len, offset, size);
+			return;
+		} else if (data->ctrl_file == CTRL_XFER) {
+			dbg("addr=%d xfer", data->cli->addr);
+
+			/* The last transaction's result is read once */
+			size = min(size, data->len);
+			fuse_reply_buf(req, data->buf, size);
+			data->len -= size;
+			memmove(data->buf, data->buf + size, data->len);
+			return;
+		} else if (data->ctrl_file == CTRL_REGS) {
+			rbuf = malloc(size);
+			if (!rbuf) {
+				fuse_reply_err(req, ENOMEM);
+				return;
+			}
+
+			ret = regs_read(data->cli, data->table, rbuf, size,
+					offset);
+			if (ret < 0)
+				fuse_reply_err(req, -ret);
+			else
+				fuse_reply_buf(req, rbuf, ret);
+			free(rbuf);
+			return;
 		} else
                 	BUG();
 	} else if (!data->cli) {		/* Is it a global ctrl file? */
                 if (data->ctrl_file == CTRL_EXPORTS) {
 			dbg("exports");
 
-			return -EACCES;
+			fuse_reply_err(req, EACCES);
+			return;
+		} else if (data->ctrl_file == CTRL_CACHE ||
+			   data->ctrl_file == CTRL_SCHED ||
+			   data->ctrl_file == CTRL_STATS ||
+			   data->ctrl_file == CTRL_MAP ||
+			   data->ctrl_file == CTRL_SCAN) {
+			dbg("cache/sched/stats/map/scan");
+
+			reply_buf(req, data->buf, data->len, offset, size);
+			return;
 		} else
                 	BUG();
 	}
@@ -420,240 +2818,363 @@ static int modbusfs_read(const char *path, char *buf,
 	BUG();
 }
 
-static int modbusfs_write(const char *path, const char *buf,
-			  size_t size, off_t offset, struct fuse_file_info *fi)
+static void modbusfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+			   size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	struct modbusfs_data_s *data = (struct modbusfs_data_s *)fi->fh;
-	int addr, idx;
-	unsigned int mode;
-	struct modbusfs_client_s *cli;
-	struct modbusfs_register_s *reg;
+	struct modbusfs_data_s *data = (struct modbusfs_data_s *) fi->fh;
 	int ret;
-	int val;
 
-	dbg("path=%s", path);
+	dbg("ino=%lx", ino);
 
-	if (data->cli && data->reg) {		/* Is it a client register? */
-               	addr = data->cli->addr;
-               	idx = data->reg->idx;
-		dbg("addr=%d idx=%d", addr, idx);
+	if (data->reg) {
+		reg_write(req, data, buf, size);
+		return;
+	}
 
-		/* Read user data */
-		ret = sscanf(buf, "%x", &val);
-		if (ret != 1 || val < 0 || val > 0xffff)
-			return -ENOENT;
-		dbg("val=%x", val);
+	ret = file_write(data, buf, size, offset);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
 
-		/* Write register content */
-		ret = write_register(ctx, addr, idx, val);
-		if (ret == -1)
-			return -EIO;
+static void modbusfs_open(fuse_req_t req, fuse_ino_t ino,
+			  struct fuse_file_info *fi)
+{
+	struct modbusfs_node_s n;
+	struct modbusfs_data_s *data;
+	int ret;
+	int res;
 
-	        return size;
-	} else if (data->cli && !data->reg) { 	/* Is it a client ctrl file? */
-                if (data->ctrl_file == CTRL_EXPORTS) {
-                	addr = data->cli->addr;
-			dbg("addr=%d exports", addr);
+	dbg("ino=%lx", ino);
+	ret = ino_node(ino, &n);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
 
-			/* Read user data */
-			ret = sscanf(buf, "%d %o", &idx, &mode);
-			if (ret != 2)
-				return -EINVAL;
-			dbg("idx=%d mode=%o", idx, mode);
+	/* Allocate per file data */
+	data = alloc_data(&n);
+	if (!data) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
 
-			/* Check user input */
-			if (idx < 0 || idx > 0xffff)
-				return -EINVAL;
-			if ((mode & MODE_REG_MASK) != mode)
-				return -EINVAL;
+	switch (n.type) {
+	case NODE_REGISTER :	/* /<addr>[/<table>]/<reg> */
+	case NODE_BIT :		/* /<addr>/<reg>.bits/<bit> */
+		dbg("addr=%d idx=%d bit=%d", n.cli->addr, n.reg->idx, n.bit);
+		if (!have_permissions(fi->flags, n.reg->mode)) {
+			res = EACCES;
+			goto error;
+		}
 
-                        cli = find_client(addr);
-                        if (!cli)
-                                return ENOENT;
+		data->fresh = !!(fi->flags & O_SYNC);
 
-                        reg = find_register(cli, idx);
-                        if (reg)
-                                return -EEXIST;
+		break;
 
-			ret = add_reg(cli, idx, mode);
-			if (ret < 0)
-				return ret;
+	case NODE_CTRL :	/* [/<addr>[/<table>]]/<ctrl> */
+		switch (n.ctrl_file) {
+		case CTRL_EXPORTS :
+			if ((fi->flags & O_ACCMODE) != O_WRONLY) {
+				res = EACCES;
+				goto error;
+			}
 
-		        return size;
-		} else
-                	BUG();
-	} else if (!data->cli) {		/* Is it a global ctrl file? */
-                if (data->ctrl_file == CTRL_EXPORTS) {
-			dbg("exports");
+			break;
 
-			/* Read user data */
-			ret = sscanf(buf, "%d %o", &addr, &mode);
-			if (ret != 2)
-				return -EINVAL;
+		case CTRL_CACHE :
+		case CTRL_SCHED :
+		case CTRL_STATS :
+		case CTRL_MAP :
+			if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+				res = EACCES;
+				goto error;
+			}
 
-			/* Check user input */
-			if (addr < 1 || addr > 254)
-				return -EINVAL;
-                        if ((mode & MODE_CLI_MASK) != mode)
-                                return -EINVAL;
+			if (n.ctrl_file == CTRL_CACHE)
+				data->buf = cache_dump(n.bus, &data->len);
+			else if (n.ctrl_file == CTRL_SCHED)
+				data->buf = sched_dump(n.bus, &data->len);
+			else if (n.ctrl_file == CTRL_MAP)
+				data->buf = map_dump(n.bus, &data->len);
+			else
+				data->buf = stats_dump(n.bus, n.cli, &data->len);
+			if (!data->buf) {
+				res = ENOMEM;
+				goto error;
+			}
 
-                        cli = find_client(addr);
-                        if (cli)
-                                return -EEXIST;
+			break;
 
-			ret = add_client(addr, mode);
-			if (ret < 0)
-				return ret;
+		case CTRL_SNAPSHOT :
+			/* Each open takes a new snapshot */
+			if ((fi->flags & O_ACCMODE) != O_RDONLY ||
+			    !have_permissions(fi->flags,
+					      map_mode(n.cli, REG_HOLDING))) {
+				res = EACCES;
+				goto error;
+			}
 
-		        return size;
-                } else
-                        BUG();
-	}
+			/* Queued writes must reach the slave first */
+			if (n.cli->linger) {
+				ret = wb_flush(n.cli);
+				if (ret < 0) {
+					res = -ret;
+					goto error;
+				}
+			}
 
-	BUG();
-}
+			data->buf = snapshot_dump(n.cli, &data->len);
+			if (!data->buf) {
+				res = ENOMEM;
+				goto error;
+			}
 
-static int modbusfs_open(const char *path, struct fuse_file_info *fi)
-{
-	char **elem;
-	size_t num;
-	int addr, idx;
-	struct modbusfs_data_s *data = NULL;
-	struct modbusfs_client_s *cli;
-	struct modbusfs_register_s *reg;
-	int ret;
-	int res;
+			break;
+
+		case CTRL_XFER :
+			/* Results are read by the same file which writes */
+			if ((fi->flags & O_ACCMODE) == O_RDONLY ||
+			    !have_permissions(fi->flags,
+					      map_mode(n.cli, REG_HOLDING))) {
+				res = EACCES;
+				goto error;
+			}
 
-	dbg("path=%s", path);
-	parse_path(strdupa(path), &elem, &num);
+			break;
 
-	/* Allocate per file data */
-        data = malloc(sizeof(struct modbusfs_data_s));
-        if (!data) {
-        	res = -ENOMEM;
-		goto error;
-	}
-	data->cli = NULL;
-	data->reg = NULL;
-	data->ctrl_file = CTRL_NONE;
+		case CTRL_SCAN :
+			/* Read the last results or write a new scan */
+			if ((fi->flags & O_ACCMODE) == O_RDWR) {
+				res = EACCES;
+				goto error;
+			}
 
-	switch (num) {
-	case 0 :	/* / */
-		BUG();
+			if ((fi->flags & O_ACCMODE) == O_RDONLY) {
+				data->buf = scan_dump(n.bus, &data->len);
+				if (!data->buf) {
+					res = ENOMEM;
+					goto error;
+				}
+			}
 
-	case 1 :	/* /<ctrl> */
-		if (strcmp(elem[0], "exports") == 0) {
-			if ((fi->flags & O_ACCMODE) != O_WRONLY) {
-				res = -EACCES;
+			break;
+
+		case CTRL_REGS :
+			if (!have_permissions(fi->flags,
+					      map_mode(n.cli, n.table))) {
+				res = EACCES;
 				goto error;
 			}
-			data->ctrl_file = CTRL_EXPORTS;
-		} else
-			BUG();
 
-		break;
+			/* Seekable as registers files */
+			data->flags = fi->flags;
+			fi->fh = (unsigned long) data;
+			fi->direct_io = 1;
 
-	case 2 :	/* /<addr>/<reg|ctrl> */
-                ret = sscanf(elem[0], "%d", &addr);
-                if (ret != 1) {
-                        res = -ENOENT;
-                        goto error;
-                }
-                dbg("addr=%d", addr);
-
-                cli = find_client(addr);
-                if (!cli) {
-                        res = -ENOENT;
-                        goto error;
-                }
-
-		data->cli = cli;
-
-                ret = sscanf(elem[1], "%d", &idx);
-                if (ret == 1) { /* it's a register! */
-                        dbg("idx=%d", idx);
-
-                        reg = find_register(cli, idx);
-                        if (!reg) {
-                                res = -ENOENT;
-                                goto error;
-                        }
-
-			if (!have_permissions(fi->flags, reg->mode)) {
-                                res = -EACCES;
-                                goto error;
-                        }
-
-			data->reg = reg;
-		} else if (strcmp(elem[1], "exports") == 0) {
-                        if ((fi->flags & O_ACCMODE) != O_WRONLY) {
-                                res = -EACCES;
-                                goto exit;
-                        }
-
-			data->ctrl_file = CTRL_EXPORTS;
-		} else
+			fuse_reply_open(req, fi);
+			return;
+
+		default :
 			BUG();
+		}
 
 		break;
 
-        default :
-                res = -ENOENT;
+	default :		/* directories */
+		res = EISDIR;
 		goto error;
 	}
 
+	data->flags = fi->flags;
 	fi->fh = (unsigned long) data;
 	fi->direct_io = 1;
-	fi->nonseekable = 1;
 
-exit:
-        free(elem);
-        return 0;
+	/* Registers must be re-readable by poll()ers using pread() */
+	fi->nonseekable = n.type != NODE_REGISTER && n.type != NODE_BIT;
+
+	fuse_reply_open(req, fi);
+	return;
 
 error:
-	if (data)
-		free(data);
-	free(elem);
-	return res;
+	free_data(data);
+	fuse_reply_err(req, res);
 }
 
-static int modbusfs_release(const char *path, struct fuse_file_info *fi)
+/* Flush the client's write-behind queue on close() and fsync() */
+static void modbusfs_flush(fuse_req_t req, fuse_ino_t ino,
+			   struct fuse_file_info *fi)
 {
-	struct modbusfs_data_s *data = (struct modbusfs_data_s *)fi->fh;
+	struct modbusfs_data_s *data = (struct modbusfs_data_s *) fi->fh;
+	int ret = 0;
 
-	if (data)
-		free(data);
+	dbg("ino=%lx", ino);
 
-	return 0;
+	if ((data->reg || data->ctrl_file == CTRL_REGS) &&
+	    data->table == REG_HOLDING && data->cli->linger &&
+	    (data->flags & O_ACCMODE) != O_RDONLY)
+		ret = wb_flush(data->cli);
+
+	fuse_reply_err(req, -ret);
 }
 
-static struct fuse_operations modbusfs_oper = {
-	.readdir	= modbusfs_readdir,
+static void modbusfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			   struct fuse_file_info *fi)
+{
+	modbusfs_flush(req, ino, fi);
+}
+
+/*
+ * Registers files are readable when their value changed since the last
+ * read, other files and values wider than one register are always ready
+ */
+static void modbusfs_poll(fuse_req_t req, fuse_ino_t ino,
+			  struct fuse_file_info *fi, struct fuse_pollhandle *ph)
+{
+	struct modbusfs_data_s *data = (struct modbusfs_data_s *) fi->fh;
+
+	dbg("ino=%lx", ino);
+
+	if (!data->reg || data->reg->nregs > 1) {
+		if (ph)
+			fuse_pollhandle_destroy(ph);
+		fuse_reply_poll(req, POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM);
+		return;
+	}
+
+	/* Nothing to sample for files which are never read */
+	if ((data->flags & O_ACCMODE) == O_WRONLY ||
+	    is_broadcast(data->cli->addr)) {
+		if (ph)
+			fuse_pollhandle_destroy(ph);
+		fuse_reply_poll(req, POLLOUT | POLLWRNORM);
+		return;
+	}
+
+	fuse_reply_poll(req, monitor_poll(data, ph) | POLLOUT | POLLWRNORM);
+}
+
+static void modbusfs_release(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_file_info *fi)
+{
+	free_data((struct modbusfs_data_s *) fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops modbusfs_oper = {
+	.init		= modbusfs_init,
+	.lookup		= modbusfs_lookup,
 	.getattr	= modbusfs_getattr,
-	.truncate	= modbusfs_truncate,
+	.setattr	= modbusfs_setattr,
+	.opendir	= modbusfs_opendir,
+	.readdir	= modbusfs_readdir,
+	.releasedir	= modbusfs_releasedir,
 	.read		= modbusfs_read,
 	.write		= modbusfs_write,
 	.open		= modbusfs_open,
+	.flush		= modbusfs_flush,
+	.fsync		= modbusfs_fsync,
 	.release	= modbusfs_release,
+	.poll		= modbusfs_poll,
 };
 
-int modbusfs_start(struct fuse_args args,
-		   enum modbus_type_e modbus_type,
-		   struct modbus_parms_s modbus_parms)
+int modbusfs_start(struct fuse_args args, int num,
+		   enum modbus_type_e *modbus_type,
+		   struct modbus_parms_s *modbus_parms)
 {
+	modbus_t *ctx[TCP_CONNS_MAX];
+	int conns, depth;
+	struct fuse_session *se;
+	char *mountpoint = NULL;
+	int multithreaded, foreground;
+	int b, c;
+	int ret = -1;
+
 	/*
 	 * Connect to the MODBUS devices
 	 */
 
-	ctx = client_connect(modbus_type, modbus_parms);
-	if (!ctx) {
-		err("modbus connection failed: %s", modbus_strerror(errno));
+	buses = calloc(num, sizeof(struct modbusfs_bus_s));
+	if (!buses) {
+		err("cannot allocate buses data");
 		return -1;
 	}
+	buses_num = num;
+
+	for (b = 0; b < buses_num; b++) {
+		conns = depth = 1;
+		if (modbus_type[b] == TCP) {
+			conns = modbus_parms[b].tcp.conns;
+			depth = modbus_parms[b].tcp.depth;
+		}
+
+		for (c = 0; c < conns; c++) {
+			ctx[c] = client_connect(modbus_type[b], modbus_parms[b]);
+			if (!ctx[c]) {
+				err("modbus connection failed: %s",
+				    modbus_strerror(errno));
+				return -1;
+			}
+		}
+
+		if (bus_init(&buses[b], b, ctx, conns, depth) < 0) {
+			err("cannot allocate bus%d data", b);
+			return -1;
+		}
+	}
+
+	/* Export the map's clients and registers all at once */
+	if (map_file && map_load(map_file) < 0)
+		return -1;
 
 	/*
 	 * Start FUSE
 	 */
 
-	return fuse_main(args.argc, args.argv, &modbusfs_oper, NULL);
+	if (fuse_parse_cmdline(&args, &mountpoint,
+			       &multithreaded, &foreground) == -1)
+		goto free_args;
+
+	chan = fuse_mount(mountpoint, &args);
+	if (!chan)
+		goto free_args;
+
+	se = fuse_lowlevel_new(&args, &modbusfs_oper,
+			       sizeof(modbusfs_oper), NULL);
+	if (!se)
+		goto unmount;
+
+	if (fuse_set_signal_handlers(se) == -1)
+		goto destroy;
+	fuse_session_add_chan(se, chan);
+
+	if (fuse_daemonize(foreground) == -1)
+		goto remove;
+
+	/*
+	 * The bus workers must be started here since fuse_daemonize()
+	 * may fork() into the background and threads don't survive it.
+	 */
+	for (b = 0; b < buses_num; b++)
+		if (bus_start(&buses[b]) < 0)
+			goto remove;
+
+	if (multithreaded)
+		ret = fuse_session_loop_mt(se);
+	else
+		ret = fuse_session_loop(se);
+
+remove:
+	fuse_remove_signal_handlers(se);
+	fuse_session_remove_chan(chan);
+destroy:
+	fuse_session_destroy(se);
+unmount:
+	fuse_unmount(mountpoint, chan);
+free_args:
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+
+	return ret;
 }
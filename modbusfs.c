@@ -19,7 +19,6 @@
 
 #define FUSE_USE_VERSION 26
 
-#include <fuse.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -33,16 +32,20 @@
 
 int enable_debug;
 
-static enum modbus_type_e modbus_type = RTU;
-static struct modbus_parms_s modbus_parms = {
-	/* RTU */ {"/dev/ttyUSB0", 115200, 8, 'N', 1}
+static const struct modbus_parms_s modbus_parms_def = {
+	/* RTU */ {"/dev/ttyUSB0", 115200, 8, 'N', 1},
+	/* TCP */ {"127.0.0.1", MODBUS_TCP_DEFAULT_PORT, 1, 1}
 };
 
+static enum modbus_type_e modbus_type[BUSES_MAX];
+static struct modbus_parms_s modbus_parms[BUSES_MAX];
+static int buses_num;
+
 /*
  * Local functions
  */
 
-static int parse_rtu_opts(char *opts)
+static int parse_rtu_opts(char *opts, struct modbus_parms_s *parms)
 {
 	int ret;
 
@@ -50,19 +53,48 @@ static int parse_rtu_opts(char *opts)
 		return 0;	/* use defaults */
 
 	ret = sscanf(opts, "%" to_str(SERIAL_DEV_MAX) "[a-zA-Z0-9/_],%d,%d%c%d",
-		     modbus_parms.rtu.serial_dev,
-		     &modbus_parms.rtu.baud,
-		     &modbus_parms.rtu.bytes,
-		     &modbus_parms.rtu.parity, &modbus_parms.rtu.stop);
+		     parms->rtu.serial_dev,
+		     &parms->rtu.baud,
+		     &parms->rtu.bytes,
+		     &parms->rtu.parity, &parms->rtu.stop);
 	if (ret < 1)
 		return -1;
 
 	dbg("serial_dev=%s baud=%d bytes=%d parity=%c stop=%d",
-				     modbus_parms.rtu.serial_dev,
-				     modbus_parms.rtu.baud,
-				     modbus_parms.rtu.bytes,
-				     modbus_parms.rtu.parity,
-				     modbus_parms.rtu.stop);
+				     parms->rtu.serial_dev,
+				     parms->rtu.baud,
+				     parms->rtu.bytes,
+				     parms->rtu.parity,
+				     parms->rtu.stop);
+
+	return 0;
+}
+
+static int parse_tcp_opts(char *opts, struct modbus_parms_s *parms)
+{
+	int ret;
+
+	if (strlen(opts) == 0)
+		return 0;	/* use defaults */
+
+	ret = sscanf(opts, "%" to_str(TCP_HOST_MAX) "[a-zA-Z0-9._-]:%d,%d,%d",
+		     parms->tcp.host,
+		     &parms->tcp.port,
+		     &parms->tcp.conns, &parms->tcp.depth);
+	if (ret < 1)
+		return -1;
+	if (parms->tcp.port < 1 || parms->tcp.port > 65535)
+		return -1;
+	if (parms->tcp.conns < 1 || parms->tcp.conns > TCP_CONNS_MAX)
+		return -1;
+	if (parms->tcp.depth < 1 || parms->tcp.depth > TCP_DEPTH_MAX)
+		return -1;
+
+	dbg("host=%s port=%d conns=%d depth=%d",
+				     parms->tcp.host,
+				     parms->tcp.port,
+				     parms->tcp.conns,
+				     parms->tcp.depth);
 
 	return 0;
 }
@@ -73,9 +105,17 @@ static int parse_rtu_opts(char *opts)
 
 static void usage(void)
 {
-	fprintf(stderr, "usage: %s [<dev>] <mountpoint> [options]\n", NAME);
+	fprintf(stderr, "usage: %s [<dev> ...] <mountpoint> [options]\n", NAME);
 	fprintf(stderr, "where <dev> can be:\n\n"
-		"\trtu:[<ttydev>[,<baud>[,<bits><parity><stop>]]]\n");
+		"\trtu:[<ttydev>[,<baud>[,<bits><parity><stop>]]]\n"
+		"\ttcp:[<host>[:<port>[,<conns>[,<depth>]]]]\n");
+	fprintf(stderr, "\nmodbusfs options:\n\n"
+		"\t--gap=<n>\tmax registers hole between two merged "
+		"reads (default " to_str(COALESCE_GAP_DEF) ")\n"
+		"\t--turnaround=<ms>\tdelay after a broadcast request "
+		"(default " to_str(BROADCAST_DELAY_DEF) ")\n"
+		"\t--map=<file>\tclients and registers to export at "
+		"mount time\n");
 	fprintf(stderr, "\n");
 }
 
@@ -100,14 +140,72 @@ int main(int argc, char *argv[])
 
 		ptr = index(argv[i], ':');
 		if (ptr && strncmp(argv[i], "rtu", sizeof("rtu") - 1) == 0) {
-			modbus_type = RTU;
+			if (buses_num == BUSES_MAX) {
+				err("too many buses (max " to_str(BUSES_MAX) ")");
+				exit(EXIT_FAILURE);
+			}
+			modbus_type[buses_num] = RTU;
+			modbus_parms[buses_num] = modbus_parms_def;
 
-			ret = parse_rtu_opts(ptr + 1);
+			ret = parse_rtu_opts(ptr + 1, &modbus_parms[buses_num]);
 			if (ret < 0) {
 				err("invalid RTU options");
 				exit(EXIT_FAILURE);
 			}
+			buses_num++;
+
+			continue;
+		}
+
+		if (ptr && strncmp(argv[i], "tcp", sizeof("tcp") - 1) == 0) {
+			if (buses_num == BUSES_MAX) {
+				err("too many buses (max " to_str(BUSES_MAX) ")");
+				exit(EXIT_FAILURE);
+			}
+			modbus_type[buses_num] = TCP;
+			modbus_parms[buses_num] = modbus_parms_def;
+
+			ret = parse_tcp_opts(ptr + 1, &modbus_parms[buses_num]);
+			if (ret < 0) {
+				err("invalid TCP options");
+				exit(EXIT_FAILURE);
+			}
+			buses_num++;
+
+			continue;
+		}
+
+		if (strncmp(argv[i], "--gap=", sizeof("--gap=") - 1) == 0) {
+			ret = sscanf(argv[i] + sizeof("--gap=") - 1, "%d",
+				     &coalesce_gap);
+			if (ret != 1 || coalesce_gap < 0 ||
+			    coalesce_gap > MODBUS_MAX_READ_REGISTERS) {
+				err("invalid coalescing gap");
+				exit(EXIT_FAILURE);
+			}
+
+			continue;
+		}
+
+		if (strncmp(argv[i], "--turnaround=",
+			    sizeof("--turnaround=") - 1) == 0) {
+			ret = sscanf(argv[i] + sizeof("--turnaround=") - 1,
+				     "%d", &broadcast_delay);
+			if (ret != 1 || broadcast_delay < 0 ||
+			    broadcast_delay > 10000) {
+				err("invalid turnaround delay");
+				exit(EXIT_FAILURE);
+			}
+
+			continue;
+		}
 
+		if (strncmp(argv[i], "--map=", sizeof("--map=") - 1) == 0) {
+			map_file = argv[i] + sizeof("--map=") - 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--map") == 0 && i + 1 < argc) {
+			map_file = argv[++i];
 			continue;
 		}
 
@@ -123,9 +221,16 @@ int main(int argc, char *argv[])
 		fuse_opt_add_arg(&args, argv[i]);
 	}
 
+	/* No buses specified, use the default one */
+	if (buses_num == 0) {
+		modbus_type[0] = RTU;
+		modbus_parms[0] = modbus_parms_def;
+		buses_num = 1;
+	}
+
 	/*
 	 * Do the job
 	 */
 
-	return modbusfs_start(args, modbus_type, modbus_parms);
+	return modbusfs_start(args, buses_num, modbus_type, modbus_parms);
 }
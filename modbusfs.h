@@ -22,13 +22,17 @@
 
 #define FUSE_USE_VERSION 26
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <pthread.h>
+#include <time.h>
+#include <endian.h>
+#include <poll.h>
 #include <modbus.h>
 
 /*
@@ -114,16 +118,40 @@
                         WARN();                                         \
         } while(0)
 
+/* Microseconds from an unspecified starting point */
+static inline uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Milliseconds from an unspecified starting point */
+static inline uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /*
  * Global types
  */
 
 enum modbus_type_e {
 	RTU,
+	TCP,
 	__TYPE_ERROR
 };
 
 #define SERIAL_DEV_MAX		32
+#define TCP_HOST_MAX		64
+#define TCP_CONNS_MAX		8
+#define TCP_DEPTH_MAX		32
 struct modbus_parms_s {
 	struct modbus_rtu_parms_s {
 		char serial_dev[SERIAL_DEV_MAX + 1];
@@ -132,6 +160,12 @@ struct modbus_parms_s {
 		char parity;
 		int stop;
 	} rtu;
+	struct modbus_tcp_parms_s {
+		char host[TCP_HOST_MAX + 1];
+		int port;
+		int conns;		/* connections to the gateway */
+		int depth;		/* requests in flight per connection */
+	} tcp;
 };
 
 /* Per register data */
@@ -139,9 +173,104 @@ struct modbus_parms_s {
 			 S_IRGRP | S_IWGRP |		\
 			 S_IROTH | S_IWOTH)
 
+/*
+ * The cached value is packed as (timestamp_ms << 16 | value) into one
+ * 64 bits word in order to be read and updated atomically without
+ * locking. A zero means no valid value.
+ */
+#define CACHE_PACK(stamp, val)	(((uint64_t) (stamp) << 16) | (val))
+#define CACHE_STAMP(c)		((c) >> 16)
+#define CACHE_VAL(c)		((uint16_t) ((c) & 0xffff))
+
+/*
+ * Registers types, that is the MODBUS data tables. Bits (coils and
+ * discrete inputs) are handled as registers holding 0 or 1.
+ */
+enum reg_type_e {
+	REG_HOLDING,			/* read/write words (FC03, FC06, FC16) */
+	REG_INPUT,			/* read only words (FC04) */
+	REG_COIL,			/* read/write bits (FC01, FC05, FC15) */
+	REG_DISCRETE,			/* read only bits (FC02) */
+	REG_TYPES_NUM
+};
+
+#define reg_type_is_bit(t)	((t) == REG_COIL || (t) == REG_DISCRETE)
+#define reg_type_is_ro(t)	((t) == REG_INPUT || (t) == REG_DISCRETE)
+
+/* Register files content format */
+enum reg_fmt_e {
+	FMT_HEX,			/* text as "%x" (default) */
+	FMT_DEC,			/* text as "%u" */
+	FMT_LE,				/* raw uint16_t little-endian */
+	FMT_BE,				/* raw uint16_t big-endian */
+};
+
+/*
+ * Register files value type: wider values span 2 or 4 consecutive
+ * registers, which are always read and written all together
+ */
+enum reg_dtype_e {
+	DT_UINT16,			/* default */
+	DT_INT16,
+	DT_UINT32,
+	DT_INT32,
+	DT_FLOAT32,
+	DT_UINT64,
+	DT_INT64,
+	DT_FLOAT64,
+};
+
+#define dtype_nregs(t)		((t) <= DT_INT16 ? 1 : (t) <= DT_FLOAT32 ? 2 : 4)
+#define dtype_is_float(t)	((t) == DT_FLOAT32 || (t) == DT_FLOAT64)
+
+/* Register's exports options */
+struct modbusfs_reg_opts_s {
+	unsigned int ttl;		/* cache max age in ms, 0 = disabled */
+	unsigned int poll;		/* poll period in ms, 0 = disabled */
+	enum reg_fmt_e fmt;
+	unsigned int deadband;		/* min change to wake up pollers */
+	enum reg_dtype_e dtype;
+	int words_le;			/* least significant register first */
+	int bytes_le;			/* registers' bytes swapped */
+	int bits;			/* "<idx>.bits" view */
+};
+
+/* Sampling period of poll()ed registers without a poll period */
+#define MONITOR_PERIOD	250
+
 struct modbusfs_register_s {
+	enum reg_type_e type;
 	int idx;
+	int exported;
 	unsigned int mode;
+	unsigned int ttl;		/* cache max age in ms, 0 = disabled */
+	unsigned int poll;		/* poll period in ms, 0 = disabled */
+	enum reg_fmt_e fmt;
+	unsigned int deadband;
+	enum reg_dtype_e dtype;
+	int nregs;			/* registers spanned by the value */
+	int words_le;
+	int bytes_le;
+	int bits;			/* has the "<idx>.bits" view */
+	int bits_handle;		/* bits files' inode handle + 1, 0 = none */
+
+	uint64_t cache;
+	uint64_t next_poll;
+
+	/*
+	 * Values wider than one register don't fit into "cache", so they
+	 * are cached into "wide" and "wide_stamp" (0 = no valid value)
+	 * protected by a sequence lock
+	 */
+	unsigned int seq;
+	uint64_t wide;
+	uint64_t wide_stamp;
+
+	/* Monitor */
+	int watchers_num;		/* files being poll()ed */
+	struct modbusfs_watch_s *watches;	/* poll handles to notify */
+	uint16_t ref;			/* last notified value */
+	int ref_valid;
 
 	struct modbusfs_client_s *cli;
 };
@@ -151,34 +280,465 @@ struct modbusfs_register_s {
 			 S_IRGRP | S_IWGRP | S_IXGRP |	\
 			 S_IROTH | S_IWOTH | S_IXOTH)
 
+#define CLIENTS_MAX	256
+#define REGS_PAGE_SIZE	256
+#define REGS_PAGES	(65536 / REGS_PAGE_SIZE)
+
+/* Client's exports options */
+struct modbusfs_cli_opts_s {
+	unsigned int linger;		/* write-behind time in ms, 0 = disabled */
+};
+
+/* Write-behind queue */
+#define WB_MAX		1024
+
+struct modbusfs_wb_entry_s {
+	uint16_t idx;
+	uint16_t val;
+};
+
+struct modbusfs_wb_s {
+	pthread_mutex_t lock;		/* protects the queues */
+	struct modbusfs_wb_entry_s *pending;	/* sorted by index */
+	int pending_num;
+	struct modbusfs_wb_entry_s *flight;	/* being written */
+	int flight_num;
+	uint64_t deadline;		/* flush time, 0 = nothing queued */
+	int err;			/* background flush error */
+
+	pthread_mutex_t flush_lock;	/* serializes flushes */
+};
+
 struct modbusfs_client_s {
 	int addr;
+	int exported;
 	unsigned int mode;
+	unsigned int linger;
+
+	struct modbusfs_wb_s wb;
 
-	struct modbusfs_register_s *regs;
+	struct modbusfs_register_s *regs[REG_TYPES_NUM][REGS_PAGES];
 	int regs_num;
+
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+
+	struct modbusfs_bus_s *bus;
 };
 
 /* Per file data */
 enum control_file_e {
 	CTRL_NONE,
-	CTRL_EXPORTS
+	CTRL_EXPORTS,
+	CTRL_CACHE,
+	CTRL_REGS,
+	CTRL_SCHED,
+	CTRL_STATS,
+	CTRL_MAP,
+	CTRL_SCAN,
+	CTRL_SNAPSHOT,
+	CTRL_XFER
 };
 
+/*
+ * The "regs" files map register "n" at offset 2 * n (big-endian) while
+ * the "bits" files map bit "n" at offset n / 8, bit n % 8 (as into the
+ * MODBUS frames)
+ */
+#define REGS_FILE_SIZE	(65536 * 2)
+#define BITS_FILE_SIZE	(65536 / 8)
+
 struct modbusfs_data_s {
+	struct modbusfs_bus_s *bus;
+	struct modbusfs_client_s *cli;
+	enum reg_type_e table;	/* client's control files table */
+	struct modbusfs_register_s *reg;
+	int bit;		/* bits file's bit, -1 for the whole register */
+	enum control_file_e ctrl_file;
+	int fresh;		/* don't use cached values */
+	int flags;		/* open() flags */
+	uint16_t seen;		/* last value read */
+	int seen_valid;
+	int watching;		/* poll()ed file */
+
+	char *buf;		/* read only control files content */
+	size_t len;		/* or directory listing */
+	size_t alloc;
+};
+
+/* Filesystem nodes */
+enum node_type_e {
+	NODE_ROOT,
+	NODE_CLIENT,
+	NODE_TABLE,			/* client's data table directory */
+	NODE_REGISTER,
+	NODE_CTRL,
+	NODE_BITS,			/* register's bits view directory */
+	NODE_BIT
+};
+
+struct modbusfs_node_s {
+	enum node_type_e type;
+	struct modbusfs_bus_s *bus;	/* NULL for the top dir of many buses */
 	struct modbusfs_client_s *cli;
+	enum reg_type_e table;		/* holding registers are in the client dir */
 	struct modbusfs_register_s *reg;
+	int bit;			/* -1 if not a bits file */
 	enum control_file_e ctrl_file;
 };
 
+/*
+ * Inode numbers are derived from the node's kind, bus, client's address
+ * and register's index, so no inode table is needed and each node keeps
+ * the same number for the whole filesystem's life:
+ *
+ *	 31  28 27  24 23     16 15              0
+ *	| kind | bus  |  addr   |       idx       |
+ *
+ * They must fit into 32 bits since fuse_ino_t is an unsigned long. The
+ * top directory is FUSE_ROOT_ID, that is kind INO_ROOT. Each registers
+ * type has its own kind starting from INO_REGISTER. Bits files have no
+ * room for the register's index, so they use its bits view handle (see
+ * index.c).
+ */
+enum ino_kind_e {
+	INO_ROOT,
+	INO_BUS,		/* bus<n> directory */
+	INO_BUS_CTRL,		/* bus's control file (idx is the file) */
+	INO_CLIENT,
+	INO_CLIENT_CTRL,	/* client's control file (idx is table << 8 | file) */
+	INO_TABLE,		/* client's table directory (idx is the type) */
+	INO_REGISTER,
+	INO_REGISTER_LAST = INO_REGISTER + REG_TYPES_NUM - 1,
+	INO_BITS,		/* bits view directory (idx is the register) */
+	INO_BIT,		/* bits file (addr is the bit, idx the handle) */
+};
+
+#define INO(kind, bus, addr, idx)					\
+		(((fuse_ino_t) (kind) << 28) | ((fuse_ino_t) (bus) << 24) | \
+		 ((fuse_ino_t) (addr) << 16) | (fuse_ino_t) (idx))
+#define INO_KIND(ino)		(((ino) >> 28) & 0xf)
+#define INO_BUS_ID(ino)		(((ino) >> 24) & 0xf)
+#define INO_ADDR(ino)		(((ino) >> 16) & 0xff)
+#define INO_IDX(ino)		((ino) & 0xffff)
+
+/* Per bus data */
+#define COALESCE_GAP_DEF	4
+
+/* Slaves discovery */
+#define SCAN_TIMEOUT_DEF	50	/* probes' response timeout in ms */
+#define SCAN_ID_MAX		64	/* identification bytes kept */
+
+/*
+ * Requests to the broadcast address are writes only, no slave answers
+ * them so the bus is left idle for the turnaround delay instead
+ */
+#define BROADCAST_DELAY_DEF	100	/* ms */
+#define is_broadcast(addr)	((addr) == MODBUS_BROADCAST_ADDRESS)
+
+enum bus_op_e {
+	BUS_READ_REGISTERS,
+	BUS_WRITE_REGISTER,
+	BUS_WRITE_REGISTERS,
+	BUS_READ_INPUT_REGISTERS,
+	BUS_READ_COILS,
+	BUS_READ_DISCRETE_INPUTS,
+	BUS_WRITE_COIL,
+	BUS_WRITE_COILS,
+	BUS_REPORT_SLAVE_ID,
+	BUS_MASK_WRITE_REGISTER,	/* "val" holds the AND and OR masks */
+	BUS_WRITE_AND_READ_REGISTERS,
+	BUS_OPS_NUM
+};
+
+/*
+ * Scheduling classes in priority order: writes are always control
+ * requests while reads are interactive unless marked as bulk
+ */
+enum bus_class_e {
+	CLASS_CONTROL,
+	CLASS_INTERACTIVE,
+	CLASS_BULK,
+	CLASSES_NUM
+};
+
+struct modbusfs_req_s {
+	enum bus_op_e op;
+	int addr;
+	int idx;
+	int nb;
+	uint16_t *val;			/* bits are stored as 0 or 1 */
+	int bulk;			/* background read */
+	int probe;			/* quarantined slave's probe */
+	int scan;			/* discovery probe, see scan.c */
+	unsigned int timeout;		/* response timeout in ms, 0 = adaptive */
+	int read_idx;			/* FC23 read range, into "dest" */
+	int read_nb;
+	uint16_t *dest;
+
+	/*
+	 * Asynchronous completion: if set, the callback is called by the
+	 * bus worker (without any lock held) instead of waking up
+	 * bus_wait(), and it owns the request from then on
+	 */
+	void (*callback)(struct modbusfs_req_s *req);
+	void *priv;
+
+	int ret;
+	int err;
+	int done;
+
+	enum bus_class_e class;
+	uint64_t seq;			/* submission order */
+	uint64_t stamp;			/* submission time in us */
+	struct modbusfs_req_s *next;
+};
+
+struct modbusfs_queue_s {
+	struct modbusfs_req_s *head, *tail;
+};
+
+struct modbusfs_class_stats_s {
+	unsigned long depth;		/* queued requests */
+	unsigned long reqs;		/* served requests */
+	uint64_t wait_sum;		/* queue wait in us */
+	uint64_t wait_max;
+};
+
+/*
+ * Per slave transactions statistics. Each connection has its own
+ * counters, which are written by its worker only, so they are updated
+ * without atomic read-modify-write operations and readers just sum
+ * them up. Latencies are counted into a log-linear histogram having
+ * HIST_SUB buckets per power of 2 microseconds.
+ */
+#define HIST_SUB		4
+#define HIST_BUCKETS		(26 * HIST_SUB)		/* up to ~2 minutes */
+
+struct modbusfs_stats_s {
+	unsigned long tx[BUS_OPS_NUM];	/* transactions per operation */
+	unsigned long timeouts;
+	unsigned long crc_errors;
+	unsigned long exceptions;
+	unsigned long errors;		/* all other errors */
+	unsigned long retries;		/* requests re-executed alone */
+	unsigned long bytes_tx;		/* ADU bytes sent */
+	unsigned long bytes_rx;		/* ADU bytes received */
+	uint64_t busy;			/* bus time in us */
+	uint64_t lat_max;		/* in us */
+	unsigned long lat[HIST_BUCKETS];
+};
+
+#define STAT_ADD(var, val)						\
+	__atomic_store_n(&(var), __atomic_load_n(&(var), __ATOMIC_RELAXED) + \
+			 (val), __ATOMIC_RELAXED)
+#define STAT_GET(var)		__atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+/* Requests merged into one single transaction */
+struct modbusfs_batch_s {
+	struct modbusfs_req_s *reqs;
+	int lo, hi;			/* overall registers range */
+	uint16_t val[MODBUS_MAX_READ_BITS];	/* the largest read */
+
+	int ret;
+	int err;
+	uint64_t lat;			/* execution time in us */
+	uint16_t tid;			/* MBAP transaction ID */
+	unsigned int timeout;		/* response timeout in ms */
+	int retry;			/* retry a timeout with timeout_max */
+	uint64_t deadline;		/* pipelined answer's deadline in ms */
+};
+
+/*
+ * Per slave health. The response timeout is estimated from the observed
+ * latencies (as TCP does for its retransmission timeout) so that a
+ * silent slave holds the bus as short as possible; slaves timing out
+ * QUARANTINE_FAILS times in a row are quarantined, that is their
+ * requests fail at once with EIO while the poller probes them with an
+ * exponential backoff. Protected by the bus's mutex.
+ */
+#define TIMEOUT_MIN_MS		50
+#define QUARANTINE_FAILS	3
+#define QUARANTINE_BACKOFF_MIN	1000	/* ms */
+#define QUARANTINE_BACKOFF_MAX	60000
+
+struct modbusfs_slave_s {
+	uint64_t srtt;			/* smoothed latency in us */
+	uint64_t rttvar;		/* latency variation in us */
+	int fails;			/* consecutive timeouts */
+
+	int quarantined;
+	unsigned int backoff;		/* current probe period in ms */
+	uint64_t next_probe;		/* in ms */
+	int probing;
+	struct modbusfs_req_s probe_req;
+	uint16_t probe_val;
+};
+
+struct modbusfs_conn_s {
+	struct modbusfs_bus_s *bus;
+	modbus_t *ctx;
+
+	int depth;			/* max batches in flight */
+	uint16_t tid;			/* next MBAP transaction ID */
+	int adu_extra;			/* ADU bytes besides the PDU */
+	unsigned int timeout;		/* current response timeout in ms */
+
+	struct modbusfs_stats_s *stats;	/* per slave */
+
+	pthread_t worker;
+};
+
+#define BUSES_MAX		16	/* must fit into the inode number */
+
+struct modbusfs_bus_s {
+	int id;
+	struct modbusfs_conn_s *conns;
+	int conns_num;
+
+	pthread_mutex_t mutex;		/* protects the requests queues */
+	pthread_cond_t cond;		/* new requests */
+	pthread_cond_t done_cond;	/* completed requests */
+	struct modbusfs_queue_s queue[CLASSES_NUM][CLIENTS_MAX];
+	int rr[CLASSES_NUM];		/* last served slave */
+	int skipped[CLASSES_NUM];	/* batches served by upper classes */
+	uint64_t seq;
+	struct modbusfs_class_stats_s stats[CLASSES_NUM];
+	struct modbusfs_conn_s *owner[CLIENTS_MAX];	/* connection serving a slave */
+	int inflight[CLIENTS_MAX];
+	int writing[CLIENTS_MAX];	/* writes in flight to a slave */
+	uint64_t mutex_wait;		/* contended locking time in us */
+	unsigned long mutex_contended;
+	uint64_t start;			/* workers start time in us */
+	struct modbusfs_slave_s slaves[CLIENTS_MAX];
+	unsigned int timeout_max;	/* configured response timeout in ms */
+
+	/* Exported clients */
+	pthread_mutex_t lock;		/* serializes clients & registers adding */
+	struct modbusfs_client_s *clients[CLIENTS_MAX];
+	int clients_num;
+	char *scan_buf;			/* last scan's results */
+	size_t scan_len;
+	struct modbusfs_register_s **bits_regs[REGS_PAGES];	/* by handle */
+	int bits_num;
+
+	/* Registers poller */
+	pthread_t poller;
+	pthread_mutex_t poll_mutex;
+	pthread_cond_t poll_cond;	/* new registers to poll */
+	int poll_kicked;
+};
+
 /*
  * Exported variables & functions
  */
 
 extern int enable_debug;
-
-extern int modbusfs_start(struct fuse_args args,
-			  enum modbus_type_e modbus_type,
-			  struct modbus_parms_s modbus_parms);
+extern int coalesce_gap;
+extern int broadcast_delay;
+extern const char *map_file;
+
+extern int bus_init(struct modbusfs_bus_s *bus, int id,
+		    modbus_t **ctx, int conns_num, int depth);
+extern int bus_start(struct modbusfs_bus_s *bus);
+extern void bus_submit(struct modbusfs_bus_s *bus,
+		       struct modbusfs_req_s *req);
+extern int bus_wait(struct modbusfs_bus_s *bus, struct modbusfs_req_s *req);
+extern void bus_sched_stats(struct modbusfs_bus_s *bus,
+			    struct modbusfs_class_stats_s *stats);
+extern void bus_stats(struct modbusfs_bus_s *bus, int addr,
+		      struct modbusfs_stats_s *stats);
+extern uint64_t bus_stats_percentile(const struct modbusfs_stats_s *stats,
+				     int p);
+extern void bus_slave_health(struct modbusfs_bus_s *bus, int addr,
+			     struct modbusfs_slave_s *slave);
+extern unsigned int bus_slave_timeout(const struct modbusfs_bus_s *bus,
+				      const struct modbusfs_slave_s *slave);
+extern void bus_probe(struct modbusfs_bus_s *bus, uint64_t *next);
+extern int bus_answered(int ret, int err);
+extern int bus_read_max(enum bus_op_e op);
+extern int bus_read_gap(enum bus_op_e op);
+extern const uint8_t bus_op_fc[BUS_OPS_NUM];
+extern int bus_read_registers(struct modbusfs_bus_s *bus,
+			      int addr, int idx, int nb, uint16_t *dest);
+extern int bus_write_register(struct modbusfs_bus_s *bus,
+			      int addr, int idx, uint16_t val);
+extern int bus_write_registers(struct modbusfs_bus_s *bus,
+			       int addr, int idx, int nb, const uint16_t *src);
+extern int bus_read_table(struct modbusfs_bus_s *bus, enum reg_type_e type,
+			  int addr, int idx, int nb, uint16_t *dest);
+extern int bus_write_coil(struct modbusfs_bus_s *bus,
+			  int addr, int idx, uint16_t val);
+extern int bus_write_coils(struct modbusfs_bus_s *bus,
+			   int addr, int idx, int nb, const uint16_t *src);
+extern int bus_write_and_read_registers(struct modbusfs_bus_s *bus, int addr,
+					int idx, int nb, const uint16_t *src,
+					int read_idx, int read_nb,
+					uint16_t *dest);
+extern const enum bus_op_e bus_read_op[REG_TYPES_NUM];
+
+extern int modbusfs_start(struct fuse_args args, int buses_num,
+			  enum modbus_type_e *modbus_type,
+			  struct modbus_parms_s *modbus_parms);
+
+extern struct modbusfs_client_s *find_client(struct modbusfs_bus_s *bus,
+					     int addr);
+extern int add_client(struct modbusfs_bus_s *bus, int addr, unsigned int mode,
+		      const struct modbusfs_cli_opts_s *opts);
+extern struct modbusfs_client_s *next_client(struct modbusfs_bus_s *bus,
+					     struct modbusfs_client_s *cli);
+extern struct modbusfs_register_s *find_register(struct modbusfs_client_s *cli,
+						 enum reg_type_e type, int idx);
+extern int add_reg(struct modbusfs_client_s *cli, enum reg_type_e type,
+		   int idx, unsigned int mode,
+		   const struct modbusfs_reg_opts_s *opts);
+extern int del_reg(struct modbusfs_client_s *cli, enum reg_type_e type,
+		   int idx);
+extern struct modbusfs_register_s *find_bits(struct modbusfs_bus_s *bus,
+					      int handle);
+extern struct modbusfs_register_s *next_register(struct modbusfs_client_s *cli,
+						 enum reg_type_e type,
+						 struct modbusfs_register_s *reg);
+extern uint64_t reg_value(const struct modbusfs_register_s *reg,
+			  const uint16_t *words);
+extern void reg_words(const struct modbusfs_register_s *reg, uint64_t val,
+		      uint16_t *words);
+extern void reg_cache_store(struct modbusfs_register_s *reg, uint64_t val);
+extern void reg_cache_drop(struct modbusfs_register_s *reg);
+extern uint64_t reg_cache_load(struct modbusfs_register_s *reg,
+			       uint64_t *val);
+
+#define for_each_client(bus, cli)					\
+	for (cli = next_client(bus, NULL); cli; cli = next_client(bus, cli))
+#define for_each_register(cli, type, reg)				\
+	for (reg = next_register(cli, type, NULL); reg;			\
+	     reg = next_register(cli, type, reg))
+
+extern int tcp_can_pipeline(struct modbusfs_batch_s *batch);
+extern void tcp_exec_batches(struct modbusfs_conn_s *conn,
+			     struct modbusfs_batch_s *batch, int n);
+
+struct modbusfs_scan_s;
+
+extern struct modbusfs_scan_s *scan_start(struct modbusfs_bus_s *bus,
+					  int first, int last, int step,
+					  unsigned int timeout);
+extern int scan_finish(struct modbusfs_scan_s *scan, unsigned int mode,
+		       FILE *f);
+
+extern int poller_start(struct modbusfs_bus_s *bus);
+extern void poller_kick(struct modbusfs_bus_s *bus);
+
+extern unsigned int monitor_poll(struct modbusfs_data_s *data,
+				 struct fuse_pollhandle *ph);
+extern void monitor_release(struct modbusfs_data_s *data);
+extern void monitor_sample(struct modbusfs_register_s *reg, uint16_t val);
+extern unsigned int monitor_period(struct modbusfs_register_s *reg);
+
+extern int wb_init(struct modbusfs_client_s *cli);
+extern int wb_write(struct modbusfs_client_s *cli, int idx, uint16_t val);
+extern int wb_lookup(struct modbusfs_client_s *cli, int idx, uint16_t *val);
+extern int wb_flush(struct modbusfs_client_s *cli);
+extern void wb_flush_expired(struct modbusfs_bus_s *bus, uint64_t *next);
 
 #endif /* _MODBUSFS_H */
@@ -0,0 +1,209 @@
+/*
+ * Modbusfs registers monitor
+ *
+ * Copyright (C) 2013-2014	Rodolfo Giometti <giometti@linux.it>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "modbusfs.h"
+
+/*
+ * Registers having poll()ing files are sampled by the bus's poller (at
+ * their poll period or at MONITOR_PERIOD) and each sample is passed to
+ * the monitor, which wakes up the waiting files only when the value
+ * moves beyond the register's deadband.
+ *
+ * A file is readable when the register's value differs (beyond the
+ * deadband) from the last value read by the file, or if the file never
+ * read the register. Bit files only look at their own bit, so they are
+ * woken up when it changes whatever the deadband.
+ */
+
+struct modbusfs_watch_s {
+	struct fuse_pollhandle *ph;
+	struct modbusfs_data_s *data;	/* file waiting on the handle */
+	struct modbusfs_watch_s *next;
+};
+
+/* Protects all registers' watches lists and reference values */
+static pthread_mutex_t monitor_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Local functions
+ */
+
+static int beyond_deadband(struct modbusfs_register_s *reg,
+			   uint16_t a, uint16_t b)
+{
+	return abs((int) a - (int) b) > reg->deadband;
+}
+
+/* Return true if the file sees a change from "old" to "val" */
+static int changed(struct modbusfs_data_s *data, uint16_t old, uint16_t val)
+{
+	if (data->bit >= 0)
+		return (old ^ val) >> data->bit & 1;
+
+	return beyond_deadband(data->reg, old, val);
+}
+
+/* Return the file's watch into the register's list or NULL */
+static struct modbusfs_watch_s **find_watch(struct modbusfs_data_s *data)
+{
+	struct modbusfs_watch_s **p;
+
+	for (p = &data->reg->watches; *p; p = &(*p)->next)
+		if ((*p)->data == data)
+			return p;
+
+	return NULL;
+}
+
+/*
+ * Exported functions
+ */
+
+/*
+ * Register a poll handle (if any) for the file's register and return
+ * the file's poll events
+ */
+unsigned int monitor_poll(struct modbusfs_data_s *data,
+			  struct fuse_pollhandle *ph)
+{
+	struct modbusfs_register_s *reg = data->reg;
+	struct modbusfs_watch_s *w, **p;
+	struct fuse_pollhandle *old = NULL;
+	uint64_t c;
+	int start = 0;
+	int ready;
+
+	EXIT_ON(pthread_mutex_lock(&monitor_mutex));
+	if (!data->watching) {
+		data->watching = 1;
+		if (__atomic_fetch_add(&reg->watchers_num, 1,
+				       __ATOMIC_RELAXED) == 0) {
+			reg->ref_valid = 0;
+			start = 1;
+		}
+	}
+
+	/* Each file waits on its last poll handle only */
+	if (ph) {
+		p = find_watch(data);
+		if (p) {
+			old = (*p)->ph;
+			(*p)->ph = ph;
+		} else {
+			w = malloc(sizeof(*w));
+			if (w) {
+				w->ph = ph;
+				w->data = data;
+				w->next = reg->watches;
+				reg->watches = w;
+			} else
+				old = ph;	/* just no wakeup */
+		}
+	}
+
+	c = __atomic_load_n(&reg->cache, __ATOMIC_RELAXED);
+	ready = !data->seen_valid ||
+		(c && changed(data, data->seen, CACHE_VAL(c)));
+	EXIT_ON(pthread_mutex_unlock(&monitor_mutex));
+
+	if (old)
+		fuse_pollhandle_destroy(old);
+
+	/* Not polled registers must be added to the poller's schedule */
+	if (start && !reg->poll)
+		poller_kick(reg->cli->bus);
+
+	return ready ? POLLIN | POLLRDNORM : 0;
+}
+
+/* Called on close() of a file which has been poll()ed */
+void monitor_release(struct modbusfs_data_s *data)
+{
+	struct modbusfs_watch_s *w = NULL, **p;
+
+	if (!data->watching)
+		return;
+
+	EXIT_ON(pthread_mutex_lock(&monitor_mutex));
+	p = find_watch(data);
+	if (p) {
+		w = *p;
+		*p = w->next;
+	}
+	__atomic_sub_fetch(&data->reg->watchers_num, 1, __ATOMIC_RELAXED);
+	EXIT_ON(pthread_mutex_unlock(&monitor_mutex));
+
+	if (w) {
+		fuse_pollhandle_destroy(w->ph);
+		free(w);
+	}
+}
+
+/* Called by the poller with each new value of a sampled register */
+void monitor_sample(struct modbusfs_register_s *reg, uint16_t val)
+{
+	struct modbusfs_watch_s *w, **p, *list = NULL;
+	struct modbusfs_data_s *data;
+	int moved;
+
+	EXIT_ON(pthread_mutex_lock(&monitor_mutex));
+	if (reg->watchers_num == 0) {
+		EXIT_ON(pthread_mutex_unlock(&monitor_mutex));
+		return;
+	}
+
+	moved = !reg->ref_valid || beyond_deadband(reg, val, reg->ref);
+	if (moved) {
+		reg->ref = val;
+		reg->ref_valid = 1;
+	}
+
+	/* Bit files are compared with their last read bit instead */
+	for (p = &reg->watches; (w = *p); ) {
+		data = w->data;
+		if (data->bit >= 0 ? !data->seen_valid ||
+				     changed(data, data->seen, val) : moved) {
+			*p = w->next;
+			w->next = list;
+			list = w;
+		} else
+			p = &w->next;
+	}
+	EXIT_ON(pthread_mutex_unlock(&monitor_mutex));
+
+	/* Poll handles are one shot, the kernel polls again if needed */
+	while (list) {
+		w = list;
+		list = w->next;
+
+		fuse_lowlevel_notify_poll(w->ph);
+		fuse_pollhandle_destroy(w->ph);
+		free(w);
+	}
+}
+
+/* Return the register's sampling period or 0 if not sampled */
+unsigned int monitor_period(struct modbusfs_register_s *reg)
+{
+	if (reg->poll)
+		return reg->poll;
+
+	return __atomic_load_n(&reg->watchers_num, __ATOMIC_RELAXED) ?
+		MONITOR_PERIOD : 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Modbusfs registers poller
+ *
+ * Copyright (C) 2013-2014	Rodolfo Giometti <giometti@linux.it>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "modbusfs.h"
+
+/*
+ * Each bus has a poller thread which walks the exported registers and
+ * reads the ones having a poll period into their cache word (that is
+ * the register's shadow value). All due registers are submitted at
+ * once so that the bus worker can merge them into few transactions.
+ * Registers being poll()ed are sampled too and their values passed to
+ * the monitor. The poller also flushes the write-behind queues of the
+ * bus's clients when their linger time expires and probes quarantined
+ * slaves.
+ */
+
+#define POLLER_IDLE_MS	1000
+
+/*
+ * Local functions
+ */
+
+static void poll_round(struct modbusfs_bus_s *bus, uint64_t *next)
+{
+	struct modbusfs_req_s *reqs = NULL;
+	uint16_t (*vals)[4] = NULL;
+	struct modbusfs_register_s **regs = NULL;
+	int size = 0;
+	struct modbusfs_client_s *cli;
+	struct modbusfs_register_s *reg;
+	uint64_t now = now_ms();
+	uint64_t val;
+	unsigned int period;
+	enum reg_type_e t;
+	int r, n = 0;
+	int ret;
+
+	for_each_client(bus, cli)
+		for (t = 0; t < REG_TYPES_NUM; t++)
+			for_each_register(cli, t, reg) {
+				period = monitor_period(reg);
+				if (!period)
+					continue;
+
+				if (reg->next_poll > now) {
+					*next = min(*next, reg->next_poll);
+					continue;
+				}
+
+				if (n == size) {
+					size = size ? size * 2 : 64;
+					reqs = realloc(reqs, sizeof(*reqs) * size);
+					vals = realloc(vals, sizeof(*vals) * size);
+					regs = realloc(regs, sizeof(*regs) * size);
+					EXIT_ON(!reqs || !vals || !regs);
+				}
+
+				reqs[n] = (struct modbusfs_req_s) {
+					.op	= bus_read_op[t],
+					.addr	= cli->addr,
+					.idx	= reg->idx,
+					.nb	= reg->nregs,
+					.bulk	= 1,
+				};
+				regs[n] = reg;
+				n++;
+
+				reg->next_poll = now + period;
+				*next = min(*next, reg->next_poll);
+			}
+
+	/* Arrays may have been moved by realloc() */
+	for (r = 0; r < n; r++) {
+		reqs[r].val = vals[r];
+		bus_submit(bus, &reqs[r]);
+	}
+
+	for (r = 0; r < n; r++) {
+		ret = bus_wait(bus, &reqs[r]);
+		if (ret == -1) {
+			dbg("addr=%d idx=%d poll failed: %s", reqs[r].addr,
+			    reqs[r].idx, modbus_strerror(errno));
+
+			/* Let readers go to the bus and get the error */
+			reg_cache_drop(regs[r]);
+			continue;
+		}
+
+		val = reg_value(regs[r], vals[r]);
+		reg_cache_store(regs[r], val);
+		if (regs[r]->nregs == 1)
+			monitor_sample(regs[r], val);
+	}
+
+	free(reqs);
+	free(vals);
+	free(regs);
+}
+
+static void *poller(void *arg)
+{
+	struct modbusfs_bus_s *bus = arg;
+	struct timespec ts;
+	uint64_t next, now;
+
+	for (;;) {
+		next = now_ms() + POLLER_IDLE_MS;
+		poll_round(bus, &next);
+		wb_flush_expired(bus, &next);
+		bus_probe(bus, &next);
+
+		EXIT_ON(pthread_mutex_lock(&bus->poll_mutex));
+		now = now_ms();
+		if (next > now && !bus->poll_kicked) {
+			/* poll_cond uses CLOCK_MONOTONIC as now_ms() */
+			ts.tv_sec = next / 1000;
+			ts.tv_nsec = (next % 1000) * 1000000;
+			pthread_cond_timedwait(&bus->poll_cond,
+					       &bus->poll_mutex, &ts);
+		}
+		bus->poll_kicked = 0;
+		EXIT_ON(pthread_mutex_unlock(&bus->poll_mutex));
+	}
+
+	return NULL;
+}
+
+/*
+ * Exported functions
+ */
+
+/*
+ * Wake up the poller to rebuild its schedule (new registers to poll or
+ * new write-behind deadlines)
+ */
+void poller_kick(struct modbusfs_bus_s *bus)
+{
+	EXIT_ON(pthread_mutex_lock(&bus->poll_mutex));
+	bus->poll_kicked = 1;
+	EXIT_ON(pthread_cond_signal(&bus->poll_cond));
+	EXIT_ON(pthread_mutex_unlock(&bus->poll_mutex));
+}
+
+int poller_start(struct modbusfs_bus_s *bus)
+{
+	int ret;
+
+	ret = pthread_create(&bus->poller, NULL, poller, bus);
+	if (ret) {
+		err("cannot start registers poller: %s", strerror(ret));
+		return -ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Modbusfs slaves discovery
+ *
+ * Copyright (C) 2013-2014	Rodolfo Giometti <giometti@linux.it>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "modbusfs.h"
+
+/*
+ * A scan probes a range of addresses by asking each slave for its
+ * identification ("Report Slave ID", FC17) with a short response
+ * timeout. All the probes are queued at once as bulk requests, so the
+ * bus workers send them back to back (over all the connections of a
+ * TCP bus), and more buses are scanned in parallel by starting all the
+ * scans before waiting for any of them.
+ *
+ * Any answer, even an exception from a slave not supporting FC17, tells
+ * that the address is in use, and the slave is exported as a client if
+ * it isn't yet. Missing slaves don't count into the slaves' health.
+ */
+
+struct modbusfs_probe_s {
+	struct modbusfs_req_s req;
+	uint16_t id[SCAN_ID_MAX];
+};
+
+struct modbusfs_scan_s {
+	struct modbusfs_bus_s *bus;
+	int num;
+	struct modbusfs_probe_s probes[];
+};
+
+/*
+ * Local functions
+ */
+
+/*
+ * Print an answering slave as "<addr> id=<id> run=<on|off> "<data>"",
+ * where the fields are the ones of the FC17 answer, or as "<addr> id=-"
+ * if it doesn't support FC17
+ */
+static void print_slave(FILE *f, struct modbusfs_probe_s *p)
+{
+	struct modbusfs_req_s *req = &p->req;
+	int i;
+
+	fprintf(f, "%d", req->addr);
+
+	if (req->ret == -1)
+		fprintf(f, " id=-");
+	if (req->ret > 0)
+		fprintf(f, " id=%02x", p->id[0]);
+	if (req->ret > 1)
+		fprintf(f, " run=%s", p->id[1] ? "on" : "off");
+	if (req->ret > 2) {
+		fprintf(f, " \"");
+		for (i = 2; i < req->ret; i++)
+			fputc(isprint(p->id[i]) && p->id[i] != '"' ?
+			      p->id[i] : '.', f);
+		fprintf(f, "\"");
+	}
+
+	fprintf(f, "\n");
+}
+
+/*
+ * Exported functions
+ */
+
+/* Queue the probes for the addresses from "first" to "last" */
+struct modbusfs_scan_s *scan_start(struct modbusfs_bus_s *bus,
+				   int first, int last, int step,
+				   unsigned int timeout)
+{
+	struct modbusfs_scan_s *scan;
+	struct modbusfs_probe_s *p;
+	int n = (last - first) / step + 1;
+	int i;
+
+	scan = calloc(1, sizeof(*scan) + n * sizeof(*p));
+	if (!scan)
+		return NULL;
+	scan->bus = bus;
+	scan->num = n;
+
+	dbg("bus%d: scanning %d-%d/%d timeout=%ums",
+	    bus->id, first, last, step, timeout);
+	for (i = 0; i < n; i++) {
+		p = &scan->probes[i];
+		p->req = (struct modbusfs_req_s) {
+			.op		= BUS_REPORT_SLAVE_ID,
+			.addr		= first + i * step,
+			.nb		= SCAN_ID_MAX,
+			.val		= p->id,
+			.scan		= 1,
+			.timeout	= timeout,
+		};
+		bus_submit(bus, &p->req);
+	}
+
+	return scan;
+}
+
+/*
+ * Wait for a scan's probes, export the answering slaves as clients
+ * having the "mode" permissions, print them into "f" and free the
+ * scan. Return the number of answering slaves.
+ */
+int scan_finish(struct modbusfs_scan_s *scan, unsigned int mode, FILE *f)
+{
+	struct modbusfs_bus_s *bus = scan->bus;
+	struct modbusfs_cli_opts_s opts = { 0 };
+	struct modbusfs_probe_s *p;
+	int i, n = 0;
+	int ret = 0;
+
+	for (i = 0; i < scan->num; i++)
+		bus_wait(bus, &scan->probes[i].req);
+
+	EXIT_ON(pthread_mutex_lock(&bus->lock));
+	for (i = 0; i < scan->num; i++) {
+		p = &scan->probes[i];
+		if (!bus_answered(p->req.ret, p->req.err))
+			continue;
+
+		dbg("bus%d: slave %d found", bus->id, p->req.addr);
+		print_slave(f, p);
+		n++;
+
+		if (!find_client(bus, p->req.addr) && ret == 0)
+			ret = add_client(bus, p->req.addr, mode, &opts);
+	}
+	EXIT_ON(pthread_mutex_unlock(&bus->lock));
+
+	free(scan);
+
+	return ret < 0 ? ret : n;
+}
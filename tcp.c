@@ -0,0 +1,420 @@
+/*
+ * Modbusfs MODBUS TCP pipelining
+ *
+ * Copyright (C) 2013-2014	Rodolfo Giometti <giometti@linux.it>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "modbusfs.h"
+
+/*
+ * libmodbus executes one request at time, so in order to keep several
+ * requests in flight on the same TCP connection we build the MBAP
+ * frames by ourselves, we send them all at once over the libmodbus's
+ * socket and then we match the answers by their transaction ID.
+ * Only the data access function codes are pipelined, all the others
+ * go through the blocking libmodbus functions.
+ */
+
+#define MBAP_HEADER_LEN		7
+
+/*
+ * Local functions
+ */
+
+static inline void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+static inline uint16_t get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+/* Build the request ADU of a batch and return its length */
+static int encode(struct modbusfs_batch_s *batch, uint8_t *adu)
+{
+	struct modbusfs_req_s *req = batch->reqs;
+	int i, len;
+
+	put16(&adu[0], batch->tid);
+	put16(&adu[2], 0);		/* MODBUS protocol */
+	adu[6] = req->addr;
+	adu[7] = bus_op_fc[req->op];
+
+	switch (req->op) {
+	case BUS_READ_REGISTERS:
+	case BUS_READ_INPUT_REGISTERS:
+	case BUS_READ_COILS:
+	case BUS_READ_DISCRETE_INPUTS:
+		put16(&adu[8], batch->lo);
+		put16(&adu[10], batch->hi - batch->lo + 1);
+		len = 12;
+		break;
+
+	case BUS_WRITE_REGISTER:
+		put16(&adu[8], req->idx);
+		put16(&adu[10], req->val[0]);
+		len = 12;
+		break;
+
+	case BUS_WRITE_COIL:
+		put16(&adu[8], req->idx);
+		put16(&adu[10], req->val[0] ? 0xff00 : 0x0000);
+		len = 12;
+		break;
+
+	case BUS_WRITE_REGISTERS:
+		put16(&adu[8], req->idx);
+		put16(&adu[10], req->nb);
+		adu[12] = req->nb * 2;
+		for (i = 0; i < req->nb; i++)
+			put16(&adu[13 + i * 2], req->val[i]);
+		len = 13 + req->nb * 2;
+		break;
+
+	case BUS_WRITE_COILS:
+		put16(&adu[8], req->idx);
+		put16(&adu[10], req->nb);
+		adu[12] = (req->nb + 7) / 8;
+		memset(&adu[13], 0, adu[12]);
+		for (i = 0; i < req->nb; i++)
+			if (req->val[i])
+				adu[13 + i / 8] |= 1 << (i % 8);
+		len = 13 + adu[12];
+		break;
+
+	default:
+		BUG();
+	}
+	put16(&adu[4], len - 6);
+
+	return len;
+}
+
+/* Decode the response PDU of a batch */
+static void decode(struct modbusfs_batch_s *batch, const uint8_t *pdu, int len)
+{
+	struct modbusfs_req_s *req = batch->reqs;
+	int i, nb;
+
+	batch->ret = -1;
+
+	if (len == 2 && (pdu[0] & 0x80)) {
+		batch->err = MODBUS_ENOBASE + pdu[1];
+		return;
+	}
+
+	if (pdu[0] != bus_op_fc[req->op]) {
+		batch->err = EMBBADDATA;
+		return;
+	}
+
+	switch (req->op) {
+	case BUS_READ_REGISTERS:
+	case BUS_READ_INPUT_REGISTERS:
+		nb = batch->hi - batch->lo + 1;
+		if (len != 2 + nb * 2 || pdu[1] != nb * 2) {
+			batch->err = EMBBADDATA;
+			return;
+		}
+
+		for (i = 0; i < nb; i++)
+			batch->val[i] = get16(&pdu[2 + i * 2]);
+		batch->ret = nb;
+		break;
+
+	case BUS_READ_COILS:
+	case BUS_READ_DISCRETE_INPUTS:
+		nb = batch->hi - batch->lo + 1;
+		if (len != 2 + (nb + 7) / 8 || pdu[1] != (nb + 7) / 8) {
+			batch->err = EMBBADDATA;
+			return;
+		}
+
+		for (i = 0; i < nb; i++)
+			batch->val[i] = (pdu[2 + i / 8] >> (i % 8)) & 1;
+		batch->ret = nb;
+		break;
+
+	case BUS_WRITE_REGISTER:
+		if (len != 5 ||
+		    get16(&pdu[1]) != req->idx || get16(&pdu[3]) != req->val[0]) {
+			batch->err = EMBBADDATA;
+			return;
+		}
+		batch->ret = 1;
+		break;
+
+	case BUS_WRITE_COIL:
+		if (len != 5 || get16(&pdu[1]) != req->idx ||
+		    get16(&pdu[3]) != (req->val[0] ? 0xff00 : 0x0000)) {
+			batch->err = EMBBADDATA;
+			return;
+		}
+		batch->ret = 1;
+		break;
+
+	case BUS_WRITE_REGISTERS:
+	case BUS_WRITE_COILS:
+		if (len != 5 ||
+		    get16(&pdu[1]) != req->idx || get16(&pdu[3]) != req->nb) {
+			batch->err = EMBBADDATA;
+			return;
+		}
+		batch->ret = req->nb;
+		break;
+
+	default:
+		BUG();
+	}
+}
+
+static int send_all(int s, const uint8_t *buf, int len)
+{
+	int ret;
+
+	while (len > 0) {
+		ret = send(s, buf, len, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Wait for data until "deadline", return 0 on timeout */
+static int wait_input(int s, uint64_t deadline)
+{
+	struct pollfd pfd = {
+		.fd	= s,
+		.events	= POLLIN,
+	};
+	uint64_t now;
+	int ret;
+
+	for (;;) {
+		now = now_ms();
+		if (now >= deadline)
+			return 0;
+
+		ret = poll(&pfd, 1, deadline - now);
+		if (ret == -1 && errno != EINTR)
+			return -1;
+		if (ret > 0)
+			return 1;
+	}
+}
+
+static int recv_all(int s, uint8_t *buf, int len, uint64_t deadline)
+{
+	struct pollfd pfd = {
+		.fd	= s,
+		.events	= POLLIN,
+	};
+	uint64_t now;
+	int ret;
+
+	while (len > 0) {
+		now = now_ms();
+		if (now >= deadline) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		ret = poll(&pfd, 1, deadline - now);
+		if (ret == -1 && errno != EINTR)
+			return -1;
+		if (ret <= 0)
+			continue;
+
+		ret = recv(s, buf, len, 0);
+		if (ret == 0)
+			errno = ECONNRESET;
+		if (ret <= 0) {
+			if (ret == -1 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Drop the connection's state after an error */
+static void reconnect(struct modbusfs_conn_s *conn)
+{
+	int ret;
+
+	modbus_close(conn->ctx);
+	ret = modbus_connect(conn->ctx);
+	if (ret == -1)
+		err("MODBUS reconnect error: %s", modbus_strerror(errno));
+}
+
+/*
+ * Exported functions
+ */
+
+int tcp_can_pipeline(struct modbusfs_batch_s *batch)
+{
+	/* Nothing to match, and the bus must stay idle after them */
+	if (is_broadcast(batch->reqs->addr))
+		return 0;
+
+	switch (batch->reqs->op) {
+	case BUS_READ_REGISTERS:
+	case BUS_WRITE_REGISTER:
+	case BUS_WRITE_REGISTERS:
+	case BUS_READ_INPUT_REGISTERS:
+	case BUS_READ_COILS:
+	case BUS_READ_DISCRETE_INPUTS:
+	case BUS_WRITE_COIL:
+	case BUS_WRITE_COILS:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+void tcp_exec_batches(struct modbusfs_conn_s *conn,
+		      struct modbusfs_batch_s *batch, int n)
+{
+	uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH * TCP_DEPTH_MAX];
+	uint8_t hdr[MBAP_HEADER_LEN];
+	uint8_t pdu[MODBUS_TCP_MAX_ADU_LENGTH];
+	int pending[TCP_DEPTH_MAX];
+	int s = modbus_get_socket(conn->ctx);
+	uint64_t start, now, first, last;
+	int i, len, todo;
+	int expired = 0;
+	uint16_t tid;
+	int ret;
+
+	BUG_ON(n > TCP_DEPTH_MAX);
+
+	/* Send all requests at once */
+	for (len = i = 0; i < n; i++) {
+		batch[i].tid = conn->tid++;
+		len += encode(&batch[i], &adu[len]);
+		pending[i] = 1;
+	}
+	todo = n;
+	dbg("bus%d: %d requests in flight", conn->bus->id, n);
+
+	start = now_us();
+	ret = send_all(s, adu, len);
+	if (ret == -1)
+		goto error;
+
+	/*
+	 * Then collect the answers in whatever order they come. Each batch
+	 * has its own slave's response timeout, so a silent slave doesn't
+	 * make the others' answers fail.
+	 */
+	now = now_ms();
+	for (i = 0; i < n; i++)
+		batch[i].deadline = now + batch[i].timeout;
+	while (todo > 0) {
+		now = now_ms();
+		first = UINT64_MAX;
+		last = 0;
+		for (i = 0; i < n; i++) {
+			if (!pending[i])
+				continue;
+
+			if (batch[i].deadline <= now) {
+				batch[i].ret = -1;
+				batch[i].err = ETIMEDOUT;
+				batch[i].lat = now_us() - start;
+				pending[i] = 0;
+				todo--;
+				expired = 1;
+				continue;
+			}
+			first = min(first, batch[i].deadline);
+			last = max(last, batch[i].deadline);
+		}
+		if (todo == 0)
+			break;
+
+		ret = wait_input(s, first);
+		if (ret == -1)
+			goto error;
+		if (ret == 0)
+			continue;
+
+		/* An answer is coming, give it the longest deadline */
+		ret = recv_all(s, hdr, MBAP_HEADER_LEN, last);
+		if (ret == -1)
+			goto error;
+
+		len = get16(&hdr[4]) - 1;
+		if (len < 2 || len > MODBUS_TCP_MAX_ADU_LENGTH - MBAP_HEADER_LEN) {
+			errno = EMBBADDATA;	/* stream is out of sync */
+			goto error;
+		}
+
+		ret = recv_all(s, pdu, len, last);
+		if (ret == -1)
+			goto error;
+
+		tid = get16(&hdr[0]);
+		for (i = 0; i < n; i++)
+			if (pending[i] && batch[i].tid == tid)
+				break;
+		if (i == n || hdr[6] != batch[i].reqs->addr) {
+			dbg("bus%d: dropped stale answer tid=%d",
+			    conn->bus->id, tid);
+			continue;
+		}
+
+		decode(&batch[i], pdu, len);
+		batch[i].lat = now_us() - start;
+		pending[i] = 0;
+		todo--;
+	}
+
+	/* Late answers would be read by the next libmodbus transaction */
+	if (expired)
+		reconnect(conn);
+
+	return;
+
+error:
+	ret = errno;
+	dbg("bus%d: pipeline error: %s", conn->bus->id, modbus_strerror(ret));
+	for (i = 0; i < n; i++)
+		if (pending[i]) {
+			batch[i].ret = -1;
+			batch[i].err = ret;
+			batch[i].lat = now_us() - start;
+		}
+
+	reconnect(conn);
+}
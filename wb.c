@@ -0,0 +1,310 @@
+/*
+ * Modbusfs write-behind queue
+ *
+ * Copyright (C) 2013-2014	Rodolfo Giometti <giometti@linux.it>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "modbusfs.h"
+
+/*
+ * Clients with a linger time don't write registers at once: values are
+ * kept, as the words sent on the bus, into a queue sorted by register
+ * index (a later write to the same register just replaces the queued
+ * value) and, when flushed, adjacent registers are written together by
+ * FC16 transactions.
+ *
+ * The queue is flushed on fsync() or close(), when it's full or by the
+ * bus's poller thread when the linger time of the first queued write
+ * expires. Errors of background flushes are kept and returned by the
+ * next flush. Queued values are visible to readers, even while they
+ * are being written, so a read never returns a value older than a
+ * previous write.
+ */
+
+/*
+ * Local functions
+ */
+
+/* Return the position of "idx" into the queue or where to insert it */
+static int wb_search(struct modbusfs_wb_entry_s *e, int n, int idx)
+{
+	int lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (e[mid].idx < idx)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int wb_find(struct modbusfs_wb_entry_s *e, int n, int idx,
+		   uint16_t *val)
+{
+	int i = wb_search(e, n, idx);
+
+	if (i == n || e[i].idx != idx)
+		return 0;
+
+	*val = e[i].val;
+	return 1;
+}
+
+/* Write the queued registers, adjacent ones by FC16 transactions */
+static int wb_exec(struct modbusfs_client_s *cli,
+		   struct modbusfs_wb_entry_s *e, int n)
+{
+	struct modbusfs_req_s *reqs;
+	struct modbusfs_register_s *reg;
+	uint16_t *val;
+	int i, j, r, reqs_num = 0;
+	int ret = 0;
+
+	reqs = malloc(sizeof(*reqs) * n);
+	val = malloc(sizeof(*val) * n);
+	if (!reqs || !val) {
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	for (i = 0; i < n; i = j) {
+		val[i] = e[i].val;
+		for (j = i + 1; j < n && j - i < MODBUS_MAX_WRITE_REGISTERS &&
+				e[j].idx == e[j - 1].idx + 1; j++)
+			val[j] = e[j].val;
+
+		reqs[reqs_num++] = (struct modbusfs_req_s) {
+			.op	= j - i > 1 ? BUS_WRITE_REGISTERS :
+					      BUS_WRITE_REGISTER,
+			.addr	= cli->addr,
+			.idx	= e[i].idx,
+			.nb	= j - i,
+			.val	= &val[i],
+		};
+	}
+	dbg("addr=%d %d registers by %d requests", cli->addr, n, reqs_num);
+
+	for (r = 0; r < reqs_num; r++)
+		bus_submit(cli->bus, &reqs[r]);
+
+	for (r = 0; r < reqs_num; r++) {
+		if (bus_wait(cli->bus, &reqs[r]) == -1) {
+			dbg("addr=%d idx=%d nb=%d write failed: %s", cli->addr,
+			    reqs[r].idx, reqs[r].nb, modbus_strerror(errno));
+			ret = -EIO;
+		}
+
+		/* Keep the cache in sync */
+		for (i = 0; i < reqs[r].nb; i++) {
+			reg = find_register(cli, REG_HOLDING, reqs[r].idx + i);
+			if (!reg || !(reg->ttl || reg->poll))
+				continue;
+
+			if (reqs[r].ret == -1 || reg->nregs > 1)
+				reg_cache_drop(reg);
+			else
+				reg_cache_store(reg,
+						reg_value(reg, &reqs[r].val[i]));
+		}
+	}
+
+exit:
+	free(reqs);
+	free(val);
+	return ret;
+}
+
+/* Write all queued registers and return the flush status */
+static int wb_do_flush(struct modbusfs_client_s *cli)
+{
+	struct modbusfs_wb_s *wb = &cli->wb;
+	struct modbusfs_wb_entry_s *e;
+	int ret = 0;
+
+	EXIT_ON(pthread_mutex_lock(&wb->flush_lock));
+
+	/* Move the queued values in flight, so new writes can be queued */
+	EXIT_ON(pthread_mutex_lock(&wb->lock));
+	e = wb->flight;
+	wb->flight = wb->pending;
+	wb->flight_num = wb->pending_num;
+	wb->pending = e;
+	wb->pending_num = 0;
+	wb->deadline = 0;
+	EXIT_ON(pthread_mutex_unlock(&wb->lock));
+
+	if (wb->flight_num > 0)
+		ret = wb_exec(cli, wb->flight, wb->flight_num);
+
+	EXIT_ON(pthread_mutex_lock(&wb->lock));
+	wb->flight_num = 0;
+	EXIT_ON(pthread_mutex_unlock(&wb->lock));
+
+	EXIT_ON(pthread_mutex_unlock(&wb->flush_lock));
+
+	return ret;
+}
+
+/*
+ * Exported functions
+ */
+
+int wb_init(struct modbusfs_client_s *cli)
+{
+	struct modbusfs_wb_s *wb = &cli->wb;
+
+	if (wb->pending)
+		return 0;	/* already done on a previous export */
+
+	wb->pending = malloc(sizeof(*wb->pending) * WB_MAX);
+	wb->flight = malloc(sizeof(*wb->flight) * WB_MAX);
+	if (!wb->pending || !wb->flight) {
+		free(wb->pending);
+		free(wb->flight);
+		wb->pending = wb->flight = NULL;
+		return -ENOMEM;
+	}
+	wb->pending_num = wb->flight_num = 0;
+	wb->deadline = 0;
+	wb->err = 0;
+	EXIT_ON(pthread_mutex_init(&wb->lock, NULL));
+	EXIT_ON(pthread_mutex_init(&wb->flush_lock, NULL));
+
+	return 0;
+}
+
+/* Queue a register write, the queue is flushed at once if full */
+int wb_write(struct modbusfs_client_s *cli, int idx, uint16_t val)
+{
+	struct modbusfs_wb_s *wb = &cli->wb;
+	int i, n;
+	int kick = 0;
+	int ret;
+
+	EXIT_ON(pthread_mutex_lock(&wb->lock));
+	for (;;) {
+		n = wb->pending_num;
+		i = wb_search(wb->pending, n, idx);
+		if (i < n && wb->pending[i].idx == idx) {
+			wb->pending[i].val = val;
+			break;
+		}
+		if (n < WB_MAX) {
+			memmove(&wb->pending[i + 1], &wb->pending[i],
+				sizeof(*wb->pending) * (n - i));
+			wb->pending[i].idx = idx;
+			wb->pending[i].val = val;
+			wb->pending_num = ++n;
+
+			/* The first queued write starts the linger time */
+			if (n == 1) {
+				wb->deadline = now_ms() + cli->linger;
+				kick = 1;
+			}
+			break;
+		}
+
+		/*
+		 * Another writer filled the queue and its flush didn't take
+		 * it yet, so we flush it by ourself before retrying.
+		 */
+		EXIT_ON(pthread_mutex_unlock(&wb->lock));
+		ret = wb_flush(cli);
+		if (ret < 0)
+			return ret;
+		EXIT_ON(pthread_mutex_lock(&wb->lock));
+	}
+	EXIT_ON(pthread_mutex_unlock(&wb->lock));
+
+	if (n == WB_MAX)
+		return wb_flush(cli);
+	if (kick)
+		poller_kick(cli->bus);
+
+	return 0;
+}
+
+/* Return true and the queued value if register "idx" has one */
+int wb_lookup(struct modbusfs_client_s *cli, int idx, uint16_t *val)
+{
+	struct modbusfs_wb_s *wb = &cli->wb;
+	int ret;
+
+	EXIT_ON(pthread_mutex_lock(&wb->lock));
+	ret = wb_find(wb->pending, wb->pending_num, idx, val) ||
+	      wb_find(wb->flight, wb->flight_num, idx, val);
+	EXIT_ON(pthread_mutex_unlock(&wb->lock));
+
+	return ret;
+}
+
+/*
+ * Flush the queue and return the first error since the last flush,
+ * background flushes included.
+ */
+int wb_flush(struct modbusfs_client_s *cli)
+{
+	struct modbusfs_wb_s *wb = &cli->wb;
+	int ret;
+
+	ret = wb_do_flush(cli);
+
+	EXIT_ON(pthread_mutex_lock(&wb->lock));
+	if (ret == 0)
+		ret = wb->err;
+	wb->err = 0;
+	EXIT_ON(pthread_mutex_unlock(&wb->lock));
+
+	return ret;
+}
+
+/*
+ * Flush the queues whose linger time is expired and update "next" with
+ * the earliest deadline of the others. Called by the bus's poller.
+ */
+void wb_flush_expired(struct modbusfs_bus_s *bus, uint64_t *next)
+{
+	struct modbusfs_client_s *cli;
+	uint64_t deadline;
+	int ret;
+
+	for_each_client(bus, cli) {
+		if (!cli->linger)
+			continue;
+
+		EXIT_ON(pthread_mutex_lock(&cli->wb.lock));
+		deadline = cli->wb.deadline;
+		EXIT_ON(pthread_mutex_unlock(&cli->wb.lock));
+		if (!deadline)
+			continue;
+
+		if (deadline > now_ms()) {
+			*next = min(*next, deadline);
+			continue;
+		}
+
+		ret = wb_do_flush(cli);
+		if (ret < 0) {
+			EXIT_ON(pthread_mutex_lock(&cli->wb.lock));
+			if (!cli->wb.err)
+				cli->wb.err = ret;
+			EXIT_ON(pthread_mutex_unlock(&cli->wb.lock));
+		}
+	}
+}